@@ -11,15 +11,18 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <signal.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
 #include <linux/fs.h>
 #include <linux/hdreg.h>
 #include <linux/blkpg.h>
+#include <zlib.h>
 #include "disk.h"
 #include "libefpak.h" 
 
@@ -278,6 +281,11 @@ static int disk_open(disk_handle_t* disk)
   }
   disk->part_count = i;
 
+  disk->flags = 0;
+  disk->cmp_buf = NULL;
+  disk->write_size = 0;
+  disk->skip_size = 0;
+
   /* success */
   return 0;
 
@@ -312,9 +320,15 @@ int disk_open_dev(disk_handle_t* disk, const char* name)
 
 void disk_close(disk_handle_t* disk)
 {
+  free(disk->cmp_buf);
   close(disk->fd);
 }
 
+void disk_set_flags(disk_handle_t* disk, uint32_t flags)
+{
+  disk->flags = flags;
+}
+
 int disk_seek(disk_handle_t* disk, size_t off)
 {
   const off64_t off64 = (off64_t)off * (off64_t)disk->block_size;
@@ -333,6 +347,33 @@ int disk_write
   return 0;
 }
 
+int disk_zero(disk_handle_t* disk, size_t off, size_t size)
+{
+  /* zero size blocks at off, letting the device do it if possible */
+
+  static const uint8_t zero_buf[64 * 1024];
+  size_t n;
+
+#ifdef BLKZEROOUT
+  uint64_t range[2];
+
+  range[0] = (uint64_t)off * disk->block_size;
+  range[1] = (uint64_t)size * disk->block_size;
+  if (ioctl(disk->fd, BLKZEROOUT, range) == 0) return 0;
+#endif /* BLKZEROOUT */
+
+  /* not a block device, or not supported */
+
+  for (; size; size -= n, off += n)
+  {
+    n = sizeof(zero_buf) / disk->block_size;
+    if (n > size) n = size;
+    if (disk_write(disk, off, n, zero_buf)) return -1;
+  }
+
+  return 0;
+}
+
 int disk_read
 (disk_handle_t* disk, size_t off, size_t size, uint8_t* buf)
 {
@@ -343,6 +384,96 @@ int disk_read
   return 0;
 }
 
+/* compare mode writes. the device contents are read by chunks, and */
+/* only the runs of differing sectors are written. */
+
+static const size_t cmp_buf_size = 1024 * 1024;
+
+typedef uint64_t cmp_vec_t __attribute__((vector_size(16)));
+
+static unsigned int is_same_sector(const uint8_t* a, const uint8_t* b)
+{
+  /* vectors are xor'ed and or'ed without early exit, so that the */
+  /* loop is vectorized. buffers may not be aligned. */
+
+  cmp_vec_t x = { 0, 0 };
+  cmp_vec_t va;
+  cmp_vec_t vb;
+  size_t i;
+
+  for (i = 0; i != DISK_BLOCK_SIZE; i += sizeof(cmp_vec_t))
+  {
+    memcpy(&va, a + i, sizeof(cmp_vec_t));
+    memcpy(&vb, b + i, sizeof(cmp_vec_t));
+    x |= va ^ vb;
+  }
+
+  return (x[0] | x[1]) == 0;
+}
+
+static int disk_update
+(disk_handle_t* disk, size_t off, size_t size, const uint8_t* buf)
+{
+  /* disk_write, comparing first in compare mode */
+  /* off and size in blocks */
+
+  const size_t cmp_nblk = cmp_buf_size / DISK_BLOCK_SIZE;
+  size_t run;
+  size_t i;
+  size_t n;
+
+  if ((disk->flags & DISK_FLAG_COMPARE) == 0) goto on_write;
+
+  if (disk->cmp_buf == NULL)
+  {
+    disk->cmp_buf = malloc(cmp_buf_size);
+    if (disk->cmp_buf == NULL) goto on_write;
+  }
+
+  for (; size; size -= n, off += n, buf += n * DISK_BLOCK_SIZE)
+  {
+    n = size;
+    if (n > cmp_nblk) n = cmp_nblk;
+
+    if (disk_read(disk, off, n, disk->cmp_buf))
+    {
+      if (disk_write(disk, off, n, buf)) return -1;
+      disk->write_size += n * DISK_BLOCK_SIZE;
+      continue ;
+    }
+
+    /* write runs of differing sectors */
+    for (i = 0; i != n; i += run)
+    {
+      const uint8_t* const a = buf + i * DISK_BLOCK_SIZE;
+      const uint8_t* const b = disk->cmp_buf + i * DISK_BLOCK_SIZE;
+      const unsigned int is_same = is_same_sector(a, b);
+
+      for (run = 1; (i + run) != n; ++run)
+      {
+	const size_t j = (i + run) * DISK_BLOCK_SIZE;
+	if (is_same_sector(buf + j, disk->cmp_buf + j) != is_same) break ;
+      }
+
+      if (is_same)
+      {
+	disk->skip_size += run * DISK_BLOCK_SIZE;
+	continue ;
+      }
+
+      if (disk_write(disk, off + i, run, a)) return -1;
+      disk->write_size += run * DISK_BLOCK_SIZE;
+    }
+  }
+
+  return 0;
+
+ on_write:
+  if (disk_write(disk, off, size, buf)) return -1;
+  disk->write_size += size * DISK_BLOCK_SIZE;
+  return 0;
+}
+
 #if 0 /* dance configuration */
 
 typedef struct conf_header
@@ -534,41 +665,548 @@ static void get_mbe_addr
 
 /* disk update routines */
 
+/* pipelined disk writes. the decoded data are copied in large */
+/* buffers, written to the device by a writer thread while the */
+/* next ones are decoded. the buffers form a ring, filled at head */
+/* by the decoding thread and written at tail by the writer one. */
+
+static const size_t pipe_buf_size = 1024 * 1024;
+
+#define WRITE_PIPE_OP_COUNT 4
+
+typedef struct write_op
+{
+  /* off and size in blocks. zero runs have no data */
+  size_t off;
+  size_t size;
+  unsigned int is_zero;
+  uint8_t* data;
+} write_op_t;
+
+typedef struct write_pipe
+{
+  disk_handle_t* disk;
+
+  /* operations ring, count the pushed ones not yet written */
+  write_op_t ops[WRITE_PIPE_OP_COUNT];
+  size_t head;
+  size_t tail;
+  size_t count;
+
+  /* the writer thread, or writes done by the caller if 0 */
+  unsigned int has_thread;
+  unsigned int is_stopping;
+  int err;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t push_cond;
+  pthread_cond_t pop_cond;
+
+} write_pipe_t;
+
+static int pipe_do_op(disk_handle_t* disk, const write_op_t* op)
+{
+  if (op->is_zero) return disk_zero(disk, op->off, op->size);
+  return disk_update(disk, op->off, op->size, op->data);
+}
+
+static void* pipe_main(void* arg)
+{
+  write_pipe_t* const pipe = arg;
+  write_op_t* op;
+  int err;
+
+  pthread_mutex_lock(&pipe->lock);
+
+  while (1)
+  {
+    while ((pipe->is_stopping == 0) && (pipe->count == 0))
+      pthread_cond_wait(&pipe->push_cond, &pipe->lock);
+
+    if (pipe->count == 0) break ;
+
+    op = &pipe->ops[pipe->tail];
+
+    /* once an error occured, the remaining operations are dropped */
+    if (pipe->err == 0)
+    {
+      pthread_mutex_unlock(&pipe->lock);
+      err = pipe_do_op(pipe->disk, op);
+      pthread_mutex_lock(&pipe->lock);
+      if (err) pipe->err = -1;
+    }
+
+    op->size = 0;
+    op->is_zero = 0;
+    pipe->tail = (pipe->tail + 1) % WRITE_PIPE_OP_COUNT;
+    --pipe->count;
+    pthread_cond_signal(&pipe->pop_cond);
+  }
+
+  pthread_mutex_unlock(&pipe->lock);
+
+  return NULL;
+}
+
+static void pipe_init(write_pipe_t* pipe, disk_handle_t* disk)
+{
+  /* fall back to writes by the caller if the thread cannot start */
+
+  size_t i;
+
+  pipe->disk = disk;
+  pipe->head = 0;
+  pipe->tail = 0;
+  pipe->count = 0;
+  pipe->has_thread = 0;
+  pipe->is_stopping = 0;
+  pipe->err = 0;
+
+  for (i = 0; i != WRITE_PIPE_OP_COUNT; ++i)
+  {
+    pipe->ops[i].size = 0;
+    pipe->ops[i].is_zero = 0;
+    pipe->ops[i].data = malloc(pipe_buf_size);
+    if (pipe->ops[i].data == NULL) goto on_error_0;
+  }
+
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->push_cond, NULL);
+  pthread_cond_init(&pipe->pop_cond, NULL);
+
+  if (pthread_create(&pipe->thread, NULL, pipe_main, pipe))
+    goto on_error_1;
+
+  pipe->has_thread = 1;
+
+  return ;
+
+ on_error_1:
+  pthread_cond_destroy(&pipe->pop_cond);
+  pthread_cond_destroy(&pipe->push_cond);
+  pthread_mutex_destroy(&pipe->lock);
+ on_error_0:
+  for (; i; --i) free(pipe->ops[i - 1].data);
+}
+
+static int pipe_push(write_pipe_t* pipe)
+{
+  /* hand the head operation to the writer, and wait for the next */
+  /* one to be free */
+
+  write_op_t* const op = &pipe->ops[pipe->head];
+  int err;
+
+  if (pipe->has_thread == 0)
+  {
+    err = pipe_do_op(pipe->disk, op);
+    op->size = 0;
+    op->is_zero = 0;
+    return err;
+  }
+
+  if (op->size == 0) return 0;
+
+  pthread_mutex_lock(&pipe->lock);
+
+  pipe->head = (pipe->head + 1) % WRITE_PIPE_OP_COUNT;
+  ++pipe->count;
+  pthread_cond_signal(&pipe->push_cond);
+
+  while (pipe->count == WRITE_PIPE_OP_COUNT)
+    pthread_cond_wait(&pipe->pop_cond, &pipe->lock);
+
+  err = pipe->err;
+
+  pthread_mutex_unlock(&pipe->lock);
+
+  return err;
+}
+
+static int pipe_write
+(write_pipe_t* pipe, size_t off, size_t size, const uint8_t* buf)
+{
+  /* off and size in blocks. buf is copied, and may be reused */
+
+  const size_t nblk = pipe_buf_size / DISK_BLOCK_SIZE;
+  write_op_t* op = &pipe->ops[pipe->head];
+  size_t n;
+
+  if (pipe->has_thread == 0)
+  {
+    op->off = off;
+    op->size = size;
+    op->data = (uint8_t*)buf;
+    return pipe_push(pipe);
+  }
+
+  /* push the head operation if not contiguous */
+  if (op->size && ((op->is_zero) || ((op->off + op->size) != off)))
+  {
+    if (pipe_push(pipe)) return -1;
+    op = &pipe->ops[pipe->head];
+  }
+
+  for (; size; size -= n, off += n, buf += n * DISK_BLOCK_SIZE)
+  {
+    if (op->size == 0) op->off = off;
+
+    n = nblk - op->size;
+    if (n > size) n = size;
+
+    memcpy(op->data + op->size * DISK_BLOCK_SIZE, buf, n * DISK_BLOCK_SIZE);
+    op->size += n;
+
+    if (op->size == nblk)
+    {
+      if (pipe_push(pipe)) return -1;
+      op = &pipe->ops[pipe->head];
+    }
+  }
+
+  return 0;
+}
+
+static int pipe_zero(write_pipe_t* pipe, size_t off, size_t size)
+{
+  /* off and size in blocks */
+
+  write_op_t* op = &pipe->ops[pipe->head];
+
+  if (op->size)
+  {
+    if (pipe_push(pipe)) return -1;
+    op = &pipe->ops[pipe->head];
+  }
+
+  op->off = off;
+  op->size = size;
+  op->is_zero = 1;
+
+  return pipe_push(pipe);
+}
+
+static int pipe_fini(write_pipe_t* pipe)
+{
+  /* write the pending operations and stop the writer */
+
+  size_t i;
+  int err;
+
+  if (pipe->has_thread == 0) return 0;
+
+  err = pipe_push(pipe);
+
+  pthread_mutex_lock(&pipe->lock);
+  pipe->is_stopping = 1;
+  pthread_cond_signal(&pipe->push_cond);
+  pthread_mutex_unlock(&pipe->lock);
+
+  pthread_join(pipe->thread, NULL);
+
+  if (pipe->err) err = -1;
+
+  pthread_cond_destroy(&pipe->pop_cond);
+  pthread_cond_destroy(&pipe->push_cond);
+  pthread_mutex_destroy(&pipe->lock);
+
+  for (i = 0; i != WRITE_PIPE_OP_COUNT; ++i) free(pipe->ops[i].data);
+
+  return err;
+}
+
 static int disk_write_with_efpak
 (disk_handle_t* disk, efpak_istream_t* is, size_t off, size_t size)
 {
-  const uint8_t* p;
+  const efpak_sparse_ext_t* sparse;
+  unsigned int is_unused = 0;
+  unsigned int is_partial = 0;
+  write_pipe_t pipe;
+  struct iovec iov[16];
+  size_t count;
   size_t i;
+  size_t j;
   size_t n;
+  size_t z;
+  int err = -1;
+
+  /* holes of unused filesystem blocks are left as is */
+  sparse = (const efpak_sparse_ext_t*)efpak_header_find_ext
+    (is->header, EFPAK_EXT_SPARSE);
+  if (sparse != NULL) is_unused = sparse->flags & EFPAK_SPARSE_FLAG_UNUSED;
+
+  /* data are decoded by this thread while written by the pipe one */
+  pipe_init(&pipe, disk);
 
   for (i = 0; i != size; i += n, off += n)
   {
     if (size != (size_t)-1) n = (size - i) * DISK_BLOCK_SIZE;
     else n = (size_t)-1;
 
-    if (efpak_istream_next(is, &p, &n))
+    /* holes of sparse blocks are not read, and zero runs are */
+    /* zeroed by the device if possible */
+
+    z = n;
+    if (efpak_istream_next_zero(is, &z))
     {
       PERROR();
-      return -1;
+      goto on_error;
+    }
+
+    if (z != 0)
+    {
+      n = z / DISK_BLOCK_SIZE;
+      if (n && (is_unused == 0) && pipe_zero(&pipe, off, n))
+      {
+	PERROR();
+	goto on_error;
+      }
+
+      continue ;
+    }
+
+    /* decoded spans are handed to the pipe together */
+    count = sizeof(iov) / sizeof(iov[0]);
+    if (efpak_istream_next_batch(is, iov, &count, &n))
+    {
+      PERROR();
+      goto on_error;
     }
 
     if (n == 0) break ;
 
-    n /= DISK_BLOCK_SIZE;
-    if (disk_write(disk, off, n, p))
+    for (j = 0, n = 0; j != count; ++j, n += z)
+    {
+      /* a partial sector, whose bytes would be lost, can only end */
+      /* the data. otherwise the next sectors would be shifted. */
+      if (is_partial)
+      {
+	PERROR();
+	goto on_error;
+      }
+
+      is_partial = ((iov[j].iov_len % DISK_BLOCK_SIZE) != 0);
+
+      z = iov[j].iov_len / DISK_BLOCK_SIZE;
+      if (pipe_write(&pipe, off + n, z, iov[j].iov_base))
+      {
+	PERROR();
+	goto on_error;
+      }
+    }
+  }
+
+  err = 0;
+
+ on_error:
+  if (pipe_fini(&pipe))
+  {
+    PERROR();
+    err = -1;
+  }
+
+  return err;
+}
+
+static int read_with_efpak
+(efpak_istream_t* is, uint8_t* buf, size_t size, unsigned int is_add)
+{
+  /* read size bytes in buf, or add them to buf contents */
+
+  struct iovec iov[16];
+  const uint8_t* p;
+  size_t count;
+  size_t i;
+  size_t j;
+  size_t k;
+  size_t n;
+
+  for (i = 0; i != size; )
+  {
+    count = sizeof(iov) / sizeof(iov[0]);
+    n = size - i;
+
+    if (efpak_istream_next_batch(is, iov, &count, &n))
+    {
+      PERROR();
+      return -1;
+    }
+
+    if (n == 0)
     {
       PERROR();
       return -1;
     }
+
+    for (k = 0; k != count; ++k, i += n)
+    {
+      p = iov[k].iov_base;
+      n = iov[k].iov_len;
+      if (is_add == 0) memcpy(buf + i, p, n);
+      else for (j = 0; j != n; ++j) buf[i + j] += p[j];
+    }
   }
 
   return 0;
 }
 
+static int check_delta_source
+(disk_handle_t* disk, size_t src_off, const efpak_delta_header_t* dh)
+{
+  /* src_off in sectors */
+
+  static const size_t buf_size = 1024 * 1024;
+  const off64_t off64 = (off64_t)src_off * (off64_t)DISK_BLOCK_SIZE;
+  uint8_t* buf;
+  uLong crc;
+  uint64_t i;
+  size_t n;
+  int err = -1;
+
+  buf = malloc(buf_size);
+  if (buf == NULL) goto on_error_0;
+
+  crc = crc32(0, Z_NULL, 0);
+  for (i = 0; i != dh->src_size; i += n)
+  {
+    n = buf_size;
+    if ((uint64_t)n > (dh->src_size - i)) n = (size_t)(dh->src_size - i);
+    if (pread64(disk->fd, buf, n, off64 + (off64_t)i) != (ssize_t)n)
+      goto on_error_1;
+    crc = crc32(crc, buf, (uInt)n);
+  }
+
+  if ((uint32_t)crc != dh->src_crc) goto on_error_1;
+
+  err = 0;
+
+ on_error_1:
+  free(buf);
+ on_error_0:
+  return err;
+}
+
+static int disk_write_with_delta
+(disk_handle_t* disk, efpak_istream_t* is, size_t src_off, size_t off)
+{
+  /* rebuild the partition at off from the one at src_off. the */
+  /* source is checked to be the one the delta was made from. */
+  /* src_off and off in sectors */
+
+  static const size_t buf_size = 1024 * 1024;
+  const efpak_delta_header_t* const dh = &is->header->u.delta;
+  const off64_t src_off64 = (off64_t)src_off * (off64_t)DISK_BLOCK_SIZE;
+  efpak_delta_op_t op;
+  uint8_t* buf;
+  uint64_t total;
+  uint64_t i;
+  size_t pos;
+  size_t n;
+  int err = -1;
+
+  if (check_delta_source(disk, src_off, dh))
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  buf = malloc(buf_size);
+  if (buf == NULL)
+  {
+    PERROR();
+    goto on_error_0;
+  }
+
+  pos = 0;
+
+  for (total = 0; total != dh->dst_size; total += op.size)
+  {
+    if (read_with_efpak(is, (uint8_t*)&op, sizeof(op), 0)) goto on_error_1;
+
+    if (op.size > (dh->dst_size - total))
+    {
+      PERROR();
+      goto on_error_1;
+    }
+
+    if (op.op > EFPAK_DELTA_OP_DATA)
+    {
+      PERROR();
+      goto on_error_1;
+    }
+
+    if (op.op != EFPAK_DELTA_OP_DATA)
+    {
+      if ((op.src_off > dh->src_size) ||
+	  (op.size > (dh->src_size - op.src_off)))
+      {
+	PERROR();
+	goto on_error_1;
+      }
+    }
+
+    for (i = 0; i != op.size; i += n, pos += n)
+    {
+      if (pos == buf_size)
+      {
+	if (disk_update(disk, off, buf_size / DISK_BLOCK_SIZE, buf))
+	{
+	  PERROR();
+	  goto on_error_1;
+	}
+	off += buf_size / DISK_BLOCK_SIZE;
+	pos = 0;
+      }
+
+      n = buf_size - pos;
+      if ((uint64_t)n > (op.size - i)) n = (size_t)(op.size - i);
+
+      if (op.op != EFPAK_DELTA_OP_DATA)
+      {
+	const off64_t x = src_off64 + (off64_t)(op.src_off + i);
+	if (pread64(disk->fd, buf + pos, n, x) != (ssize_t)n)
+	{
+	  PERROR();
+	  goto on_error_1;
+	}
+      }
+
+      if (op.op != EFPAK_DELTA_OP_COPY)
+      {
+	const unsigned int is_add = (op.op == EFPAK_DELTA_OP_ADD);
+	if (read_with_efpak(is, buf + pos, n, is_add)) goto on_error_1;
+      }
+    }
+  }
+
+  /* pad the last sector */
+  if (pos % DISK_BLOCK_SIZE)
+  {
+    n = DISK_BLOCK_SIZE - (pos % DISK_BLOCK_SIZE);
+    memset(buf + pos, 0, n);
+    pos += n;
+  }
+
+  if (pos && disk_update(disk, off, pos / DISK_BLOCK_SIZE, buf))
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  err = 0;
+
+ on_error_1:
+  free(buf);
+ on_error_0:
+  return err;
+}
+
 static int file_write_with_efpak
 (int fd, efpak_istream_t* is, size_t size)
 {
-  const uint8_t* p;
+  struct iovec iov[16];
+  size_t count;
   size_t i;
   size_t n;
 
@@ -577,7 +1215,21 @@ static int file_write_with_efpak
     if (size != (size_t)-1) n = size - i;
     else n = (size_t)-1;
 
-    if (efpak_istream_next(is, &p, &n))
+    /* uncompressed data are copied by the kernel if possible */
+    if (efpak_istream_next_copy(is, fd, &n))
+    {
+      PERROR();
+      return -1;
+    }
+
+    if (n != 0) continue ;
+
+    if (size != (size_t)-1) n = size - i;
+    else n = (size_t)-1;
+
+    /* decoded spans are written together */
+    count = sizeof(iov) / sizeof(iov[0]);
+    if (efpak_istream_next_batch(is, iov, &count, &n))
     {
       PERROR();
       return -1;
@@ -585,7 +1237,7 @@ static int file_write_with_efpak
 
     if (n == 0) break ;
 
-    if (write(fd, p, n) != (ssize_t)n)
+    if (writev(fd, iov, (int)count) != (ssize_t)n)
     {
       PERROR();
       return -1;
@@ -623,6 +1275,9 @@ typedef struct install_handle
   const char* hook_path;
   const char* hook_av[8];
 
+  /* hook path copy, the header may not outlive its block */
+  char hook_buf[256];
+
 } install_handle_t;
 
 static int install_init
@@ -804,6 +1459,7 @@ static int install_part(install_handle_t* inst)
   size_t i;
   size_t off;
   size_t size;
+  uint64_t x;
   mbe_t* mbe;
 
   if ((inst->flags & INSTALL_FLAG_MBR) == 0)
@@ -882,13 +1538,28 @@ static int install_part(install_handle_t* inst)
 
   /* check uncompressed size wont overwrite next area */
 
-  if (h->raw_data_size > ((uint64_t)UINT32_MAX - DISK_BLOCK_SIZE))
+  if (h->type == EFPAK_BTYPE_DELTA)
+  {
+    /* delta source is the active partition */
+    x = h->u.delta.dst_size;
+    if (h->u.delta.src_size > (inst->part_size[i] * DISK_BLOCK_SIZE))
+    {
+      PERROR();
+      goto on_error;
+    }
+  }
+  else
+  {
+    x = efpak_header_get_size(h);
+  }
+
+  if (x > ((uint64_t)UINT32_MAX - DISK_BLOCK_SIZE))
   {
     PERROR();
     goto on_error;
   }
 
-  size = (size_t)inst->h->raw_data_size;
+  size = (size_t)x;
   if (size % DISK_BLOCK_SIZE) size += DISK_BLOCK_SIZE;
   size /= DISK_BLOCK_SIZE;
   if ((off + size) > (inst->area_off[i] + inst->area_size[i]))
@@ -899,7 +1570,12 @@ static int install_part(install_handle_t* inst)
 
   /* write the new partition contents */
 
-  if (disk_write_with_efpak(disk, is, off, (size_t)-1))
+  if (h->type == EFPAK_BTYPE_DELTA)
+    err = disk_write_with_delta(disk, is, inst->part_off[i], off);
+  else
+    err = disk_write_with_efpak(disk, is, off, (size_t)-1);
+
+  if (err)
   {
     PERROR();
     goto on_error;
@@ -1124,6 +1800,7 @@ static int exec_prex_hook(install_handle_t* inst, int* status)
   switch (inst->h->type)
   {
   case EFPAK_BTYPE_PART:
+  case EFPAK_BTYPE_DELTA:
     {
       inst->hook_av[2] = "part";
       switch ((efpak_partid_t)inst->h->u.part.part_id)
@@ -1164,6 +1841,7 @@ static int exec_postx_hook(install_handle_t* inst, int err, int* status)
   switch (inst->h->type)
   {
   case EFPAK_BTYPE_PART:
+  case EFPAK_BTYPE_DELTA:
     {
       inst->hook_av[2] = "part";
       switch ((efpak_partid_t)inst->h->u.part.part_id)
@@ -1256,9 +1934,10 @@ static int install_hook(install_handle_t* inst)
   path_len = (size_t)h->u.hook.path_len;
   if (path_len)
   {
-    /* TODO: check path len */
-    inst->hook_path = (const char*)h->u.hook.path;
-    if (inst->hook_path[path_len - 1]) goto on_error;
+    if (path_len > sizeof(inst->hook_buf)) goto on_error;
+    if (h->u.hook.path[path_len - 1]) goto on_error;
+    memcpy(inst->hook_buf, h->u.hook.path, path_len);
+    inst->hook_path = inst->hook_buf;
   }
 
   inst->hook_av[0] = inst->hook_path;
@@ -1306,6 +1985,7 @@ static int install_efpak(install_handle_t* inst)
     switch (inst->h->type)
     {
     case EFPAK_BTYPE_FORMAT:
+    case EFPAK_BTYPE_TOC:
       {
 	goto skip_block;
 	break ;
@@ -1318,6 +1998,7 @@ static int install_efpak(install_handle_t* inst)
       }
 
     case EFPAK_BTYPE_PART:
+    case EFPAK_BTYPE_DELTA:
       {
 	err = install_part(inst);
 	break ;
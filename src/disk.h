@@ -30,14 +30,25 @@ typedef struct disk_handle
   uint64_t part_off[DISK_MAX_PART_COUNT];
   uint64_t part_size[DISK_MAX_PART_COUNT];
 
+  /* read the device contents and write only the differing sectors */
+#define DISK_FLAG_COMPARE (1 << 0)
+  uint32_t flags;
+  uint8_t* cmp_buf;
+
+  /* written and skipped sizes, in bytes */
+  uint64_t write_size;
+  uint64_t skip_size;
+
 } disk_handle_t;
 
 
 int disk_open_root(disk_handle_t*);
 int disk_open_dev(disk_handle_t*, const char*);
 void disk_close(disk_handle_t*);
+void disk_set_flags(disk_handle_t*, uint32_t);
 int disk_seek(disk_handle_t*, size_t);
 int disk_write(disk_handle_t*, size_t, size_t, const uint8_t*);
+int disk_zero(disk_handle_t*, size_t, size_t);
 int disk_read(disk_handle_t*, size_t, size_t, uint8_t*);
 int disk_install_with_efpak(disk_handle_t*, efpak_istream_t*);
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _BSD_SOURCE
 #define _LARGEFILE64_SOURCE
 
@@ -12,6 +13,19 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif /* CONFIG_ZSTD */
+#ifdef CONFIG_LZ4
+#include <lz4frame.h>
+#endif /* CONFIG_LZ4 */
+#ifdef CONFIG_XZ
+#include <lzma.h>
+#endif /* CONFIG_XZ */
+#ifdef CONFIG_LIBDEFLATE
+#include <libdeflate.h>
+#endif /* CONFIG_LIBDEFLATE */
 #include "libefpak.h"
 
 
@@ -45,6 +59,50 @@ static void inflate_reset_partial(efpak_inflate_t* inflate)
   z->avail_out = (uInt)inflate->osize;
 }
 
+/* zlib allocations are served from an arena following the output */
+/* buffer, so that a decoder context is a single allocation. it */
+/* holds the inflate state and window, falling back to malloc. */
+
+static const size_t inflate_arena_size = 48 * 1024;
+
+static voidpf inflate_zalloc(voidpf opaque, uInt n, uInt size)
+{
+  efpak_inflate_t* const inflate = opaque;
+  const size_t x = ((size_t)n * (size_t)size + 15) & ~(size_t)15;
+  uint8_t* p;
+
+  if (x > (inflate->arena_size - inflate->arena_off)) return malloc(x);
+
+  p = inflate->arena + inflate->arena_off;
+  inflate->arena_off += x;
+
+  return p;
+}
+
+static void inflate_zfree(voidpf opaque, voidpf p)
+{
+  /* arena allocations are freed with the context */
+
+  efpak_inflate_t* const inflate = opaque;
+  const uint8_t* const x = p;
+
+  if ((x >= inflate->arena) && (x < (inflate->arena + inflate->arena_size)))
+    return ;
+
+  free(p);
+}
+
+static void inflate_reset_points(efpak_inflate_t* inflate)
+{
+  /* the allocated points are kept */
+
+  inflate->point_count = 0;
+  inflate->point_max = 0;
+  inflate->point_span = 0;
+  inflate->ibase = NULL;
+  inflate->raw_base = 0;
+}
+
 static int inflate_init
 (efpak_inflate_t* inflate, size_t osize)
 {
@@ -52,19 +110,30 @@ static int inflate_init
 
   z_stream* const z = &inflate->z;
 
+  /* the output buffer is 16 bytes aligned, as is the arena */
+  osize = (osize + 15) & ~(size_t)15;
+
   inflate->osize = osize;
-  inflate->obuf = malloc(osize);
+  inflate->obuf = malloc(osize + inflate_arena_size);
   if (inflate->obuf == NULL)
   {
     PERROR();
     goto on_error_0;
   }
 
+  inflate->arena = inflate->obuf + osize;
+  inflate->arena_size = inflate_arena_size;
+  inflate->arena_off = 0;
+
   inflate_reset_partial(inflate);
 
-  z->zalloc = Z_NULL;
-  z->zfree = Z_NULL;
-  z->opaque = Z_NULL;
+  inflate->points = NULL;
+  inflate->point_size = 0;
+  inflate_reset_points(inflate);
+
+  z->zalloc = inflate_zalloc;
+  z->zfree = inflate_zfree;
+  z->opaque = inflate;
 
   /* http://stackoverflow.com/questions/1838699/ */
   /* how-can-i-inflateress-a-gzip-stream-with-zlib */
@@ -77,7 +146,7 @@ static int inflate_init
   return 0;
 
  on_error_1:
-  free(z->next_out);
+  free(inflate->obuf);
  on_error_0:
   return -1;
 }
@@ -93,18 +162,40 @@ static int inflate_fini
     return -1;
   }
 
+  free(inflate->points);
   free(inflate->obuf);
 
   return 0;
 }
 
-__attribute__((unused))
 static int inflate_reset
 (efpak_inflate_t* inflate)
 {
+  /* reuse a context for a new gzip stream. the window bits are */
+  /* set again, as a restart may have changed them to raw deflate */
+
+  z_stream* const z = &inflate->z;
+
+  if (inflateReset2(z, 16 + MAX_WBITS) != Z_OK)
+  {
+    PERROR();
+    return -1;
+  }
+
+  inflate_reset_partial(inflate);
+  inflate_reset_points(inflate);
+
+  return 0;
+}
+
+static int inflate_restart
+(efpak_inflate_t* inflate, const uint8_t* ibuf, size_t isize, int wbits)
+{
+  /* restart decoding from a new single input block */
+
   z_stream* const z = &inflate->z;
 
-  if (inflateReset(z) != Z_OK)
+  if (inflateReset2(z, wbits) != Z_OK)
   {
     PERROR();
     return -1;
@@ -112,6 +203,10 @@ static int inflate_reset
 
   inflate_reset_partial(inflate);
 
+  z->next_in = (Bytef*)ibuf;
+  z->avail_in = (uInt)isize;
+  inflate->flags |= EFPAK_INFLATE_FLAG_EOI;
+
   return 0;
 }
 
@@ -151,6 +246,7 @@ static unsigned int inflate_is_done
   return 0;
 }
 
+__attribute__((unused))
 static int inflate_set_single_iblock
 (efpak_inflate_t* inflate, uint8_t* ibuf, size_t isize)
 {
@@ -159,6 +255,68 @@ static int inflate_set_single_iblock
   return 0;
 }
 
+static void inflate_add_point(efpak_inflate_t* infl)
+{
+  /* record an access point at the current deflate block boundary */
+
+  z_stream* const z = &infl->z;
+  const uint64_t raw_off = infl->raw_base + (uint64_t)z->total_out;
+  efpak_inflate_point_t* p;
+  uInt size;
+  size_t i;
+
+  if (infl->point_count)
+  {
+    /* already recorded, as when decoding again after a rewind */
+    p = &infl->points[infl->point_count - 1];
+    if (raw_off < (p->raw_off + (uint64_t)infl->point_span)) return ;
+  }
+  else if (raw_off < (uint64_t)infl->point_span)
+  {
+    return ;
+  }
+
+  if (infl->point_count == infl->point_max)
+  {
+    /* keep every other point, doubling the span */
+    for (i = 1; (2 * i) < infl->point_count; ++i)
+      memcpy(&infl->points[i], &infl->points[2 * i], sizeof(*p));
+    infl->point_count = i;
+    infl->point_span *= 2;
+    p = &infl->points[infl->point_count - 1];
+    if (raw_off < (p->raw_off + (uint64_t)infl->point_span)) return ;
+  }
+
+  if (infl->point_count == infl->point_size)
+  {
+    /* points are allocated on demand, not recorded if failing */
+    i = infl->point_size ? (2 * infl->point_size) : 4;
+    if (i > infl->point_max) i = infl->point_max;
+    p = realloc(infl->points, i * sizeof(efpak_inflate_point_t));
+    if (p == NULL) return ;
+    infl->points = p;
+    infl->point_size = i;
+  }
+
+  p = &infl->points[infl->point_count];
+
+  size = EFPAK_INFLATE_WINDOW_SIZE;
+  if (inflateGetDictionary(z, p->window, &size) != Z_OK) return ;
+
+  p->raw_off = raw_off;
+  p->comp_off = (size_t)((const uint8_t*)z->next_in - infl->ibase);
+  p->bits = z->data_type & 7;
+  p->window_size = (size_t)size;
+
+  ++infl->point_count;
+}
+
+static unsigned int is_block_boundary(const z_stream* z)
+{
+  /* end of a deflate block which is not the last one */
+  return (z->data_type & 128) && ((z->data_type & 64) == 0);
+}
+
 static int inflate_next_oblock
 (efpak_inflate_t* infl, const uint8_t** obufp, size_t* osizep)
 {
@@ -168,13 +326,30 @@ static int inflate_next_oblock
   /* inflate->osize or there is on more input left */
 
   z_stream* const z = &infl->z;
+  const int flush = infl->point_span ? Z_BLOCK : Z_NO_FLUSH;
 
-  /* produce output buffer from input */
+  /* produce output buffer from input. inflate is called even */
+  /* if there is no more input, as it may still hold output. */
+  /* with access points, it stops at deflate block boundaries. */
 
-  while (z->avail_in)
+  while ((infl->flags & EFPAK_INFLATE_FLAG_EOS) == 0)
   {
-    const int err = inflate(z, 0);
-    if ((err != Z_STREAM_END) && (err != Z_OK))
+    const int err = inflate(z, flush);
+
+    if ((err == Z_OK) && infl->point_span && is_block_boundary(z))
+      inflate_add_point(infl);
+
+    if (err == Z_STREAM_END)
+    {
+      /* ignore any trailing input */
+      infl->flags |= EFPAK_INFLATE_FLAG_EOS;
+      break ;
+    }
+
+    /* no progress possible, more input needed */
+    if (err == Z_BUF_ERROR) break ;
+
+    if (err != Z_OK)
     {
       PERROR();
       return -1;
@@ -200,415 +375,5749 @@ static int inflate_next_oblock
 }
 
 
-/* block memory type specific operations */
+/* worker thread pool */
+/* jobs are submitted by batch. the calling thread runs jobs too */
+/* and returns once all the batch jobs are done. */
 
-static void mem_init(efpak_imem_t* mem, const uint8_t* data, size_t size) 
+static void* pool_main(void* arg)
 {
-  mem->data = data;
-  mem->size = size;
-  mem->off = 0;
-}
+  efpak_pool_t* const pool = arg;
+  size_t i;
 
-static int ram_mem_seek(efpak_imem_t* mem, size_t off)
-{
-  if (off > mem->size) return -1;
-  mem->off = off;
-  return 0;
+  pthread_mutex_lock(&pool->lock);
+
+  while (1)
+  {
+    while ((pool->is_stopping == 0) && (pool->job_next == pool->job_count))
+      pthread_cond_wait(&pool->job_cond, &pool->lock);
+
+    if (pool->is_stopping) break ;
+
+    i = pool->job_next++;
+
+    pthread_mutex_unlock(&pool->lock);
+    pool->fn(pool->arg, i);
+    pthread_mutex_lock(&pool->lock);
+
+    if (++pool->job_done == pool->job_count)
+      pthread_cond_signal(&pool->done_cond);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
 }
 
-static int ram_mem_next(efpak_imem_t* mem, const uint8_t** data, size_t* size)
+static void pool_stop(efpak_pool_t* pool, size_t n)
 {
-  if (*size == (size_t)-1) *size = mem->size - mem->off;
-  if ((mem->off + *size) > mem->size) *size = mem->size - mem->off;
+  /* n the count of started threads */
 
-  *data = mem->data + mem->off;
-  mem->off += *size;
+  size_t i;
 
-  return 0;
+  pthread_mutex_lock(&pool->lock);
+  pool->is_stopping = 1;
+  pthread_cond_broadcast(&pool->job_cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 0; i != n; ++i) pthread_join(pool->threads[i], NULL);
 }
 
-static void ram_mem_fini(efpak_imem_t* mem)
+static efpak_pool_t* pool_create(size_t thread_count)
 {
+  /* thread_count includes the calling thread */
+
+  efpak_pool_t* pool;
+  size_t i;
+
+  if (thread_count <= 1) goto on_error_0;
+
+  pool = malloc(sizeof(efpak_pool_t));
+  if (pool == NULL) goto on_error_0;
+
+  pool->thread_count = thread_count - 1;
+  pool->threads = malloc(pool->thread_count * sizeof(pthread_t));
+  if (pool->threads == NULL) goto on_error_1;
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->job_cond, NULL);
+  pthread_cond_init(&pool->done_cond, NULL);
+
+  pool->job_count = 0;
+  pool->job_next = 0;
+  pool->job_done = 0;
+  pool->is_stopping = 0;
+
+  for (i = 0; i != pool->thread_count; ++i)
+  {
+    if (pthread_create(&pool->threads[i], NULL, pool_main, pool))
+      goto on_error_2;
+  }
+
+  return pool;
+
+ on_error_2:
+  pool_stop(pool, i);
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+ on_error_1:
+  free(pool);
+ on_error_0:
+  return NULL;
 }
 
-static int ram_mem_init(efpak_imem_t* mem, const uint8_t* data, size_t size)
+static void pool_destroy(efpak_pool_t* pool)
 {
-  mem_init(mem, data, size);
-  mem->seek = ram_mem_seek;
-  mem->next = ram_mem_next;
-  mem->fini = ram_mem_fini;
-  return 0;
+  if (pool == NULL) return ;
+
+  pool_stop(pool, pool->thread_count);
+  pthread_cond_destroy(&pool->done_cond);
+  pthread_cond_destroy(&pool->job_cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->threads);
+  free(pool);
 }
 
-static int inflate_mem_seek(efpak_imem_t* mem, size_t off)
+static void pool_run
+(efpak_pool_t* pool, void (*fn)(void*, size_t), void* arg, size_t n)
 {
-  size_t n;
+  /* run fn(arg, i) for i in [0, n[ and wait for completion */
+
+  size_t i;
 
-  if ((mem->off + mem->inflate_size) <= off)
+  if (pool == NULL)
   {
-    while (1)
-    {
-      mem->off += mem->inflate_size;
+    for (i = 0; i != n; ++i) fn(arg, i);
+    return ;
+  }
 
-      if (inflate_next_oblock
-	  (&mem->inflate, &mem->inflate_data, &mem->inflate_size))
-	return -1;
+  if (n == 0) return ;
 
-      if (mem->inflate_size == 0)
-	return -1;
+  pthread_mutex_lock(&pool->lock);
 
-      if ((mem->off + mem->inflate_size) > off)
-	break ;
-    }
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->job_count = n;
+  pool->job_next = 0;
+  pool->job_done = 0;
+  pthread_cond_broadcast(&pool->job_cond);
+
+  while (pool->job_next != pool->job_count)
+  {
+    i = pool->job_next++;
+
+    pthread_mutex_unlock(&pool->lock);
+    fn(arg, i);
+    pthread_mutex_lock(&pool->lock);
+
+    ++pool->job_done;
   }
 
-  n = off - mem->off;
-  mem->inflate_data += n;
-  mem->inflate_size -= n;
-  mem->off += n;
+  while (pool->job_done != pool->job_count)
+    pthread_cond_wait(&pool->done_cond, &pool->lock);
 
-  return 0;
+  pthread_mutex_unlock(&pool->lock);
 }
 
-static int inflate_mem_next
-(efpak_imem_t* mem, const uint8_t** buf, size_t* size)
+
+/* header extensions */
+
+static const size_t header_min_size = offsetof(efpak_header_t, u.per_type);
+
+static size_t get_type_header_size(const efpak_header_t* h)
 {
-  if (mem->inflate_size == 0)
-  {
-    if (inflate_next_oblock
-	(&mem->inflate, &mem->inflate_data, &mem->inflate_size))
-      return -1;
-  }
+  /* return the type specific header size, or 0 if unknown */
 
-  /* note: keep both condition for readability */
-  if ((*size == (size_t)-1) || (*size > mem->inflate_size))
+  switch ((efpak_btype_t)h->type)
   {
-    *size = mem->inflate_size;
-  }
+  case EFPAK_BTYPE_FORMAT: return sizeof(efpak_format_header_t);
+  case EFPAK_BTYPE_DISK: return sizeof(efpak_disk_header_t);
+  case EFPAK_BTYPE_PART: return sizeof(efpak_part_header_t);
 
-  *buf = mem->inflate_data;
+  case EFPAK_BTYPE_FILE:
+    return offsetof(efpak_file_header_t, path) + h->u.file.path_len;
 
-  mem->off += *size;
-  mem->inflate_data += *size;
-  mem->inflate_size -= *size;
+  case EFPAK_BTYPE_HOOK:
+    return offsetof(efpak_hook_header_t, path) + h->u.hook.path_len;
+
+  case EFPAK_BTYPE_DELTA: return sizeof(efpak_delta_header_t);
+  case EFPAK_BTYPE_TOC: return sizeof(efpak_toc_header_t);
+
+  default: break ;
+  }
 
   return 0;
 }
 
-static void inflate_mem_fini(efpak_imem_t* mem)
+const efpak_ext_header_t* efpak_header_find_ext
+(const efpak_header_t* h, uint16_t type)
 {
-  inflate_fini(&mem->inflate);
-}
+  const uint8_t* const p = (const uint8_t*)h;
+  const efpak_ext_header_t* ext;
+  size_t off;
 
-/* ASSUME((oblock_size % DISK_BLOCK_SIZE) == 0) */
-static const size_t inflate_oblock_size = 64 * 1024;
+  off = get_type_header_size(h);
+  if (off == 0) return NULL;
+  off += header_min_size;
 
-static int inflate_mem_init
-(efpak_imem_t* mem, const uint8_t* data, size_t size)
+  while ((off + sizeof(efpak_ext_header_t)) <= h->header_size)
+  {
+    ext = (const efpak_ext_header_t*)(p + off);
+    if (ext->size < sizeof(efpak_ext_header_t)) break ;
+    if ((off + ext->size) > h->header_size) break ;
+    if (ext->type == type) return ext;
+    off += ext->size;
+  }
+
+  return NULL;
+}
+
+static const efpak_index_ext_t* get_index_ext(const efpak_header_t* h)
 {
-  if (inflate_init(&mem->inflate, inflate_oblock_size))
-    goto on_error_0;
+  /* return the block chunk index if any and valid, NULL otherwise */
 
-  if (inflate_set_single_iblock(&mem->inflate, (void*)data, size))
-    goto on_error_1;
+  const efpak_index_ext_t* index;
+  uint64_t comp_off;
+  uint64_t raw_off;
+  size_t size;
+  size_t i;
 
-  mem_init(mem, data, size);
-  mem->seek = inflate_mem_seek;
-  mem->next = inflate_mem_next;
-  mem->fini = inflate_mem_fini;
+  index = (const efpak_index_ext_t*)efpak_header_find_ext(h, EFPAK_EXT_INDEX);
+  if (index == NULL) return NULL;
 
-  mem->inflate_data = NULL;
-  mem->inflate_size = 0;
+  size = offsetof(efpak_index_ext_t, entries);
+  if (index->ext.size < size) return NULL;
+  if (index->count > ((index->ext.size - size) / sizeof(efpak_index_entry_t)))
+    return NULL;
+  if (index->count == 0) return NULL;
 
-  return 0;
+  comp_off = 0;
+  raw_off = 0;
+  for (i = 0; i != index->count; ++i)
+  {
+    const efpak_index_entry_t* const e = &index->entries[i];
+    if (e->comp_off < comp_off) return NULL;
+    if (e->raw_off < raw_off) return NULL;
+    if (e->comp_off >= h->comp_data_size) return NULL;
+    if (e->raw_off >= h->raw_data_size) return NULL;
+    comp_off = e->comp_off;
+    raw_off = e->raw_off;
+  }
 
- on_error_1:
-  inflate_fini(&mem->inflate);
- on_error_0:
-  return -1;
+  return index;
 }
 
+static const efpak_dict_ext_t* get_dict_ext(const efpak_header_t* h)
+{
+  const efpak_dict_ext_t* dict;
 
-/* file mapping */
+  dict = (const efpak_dict_ext_t*)efpak_header_find_ext(h, EFPAK_EXT_DICT);
+  if (dict == NULL) return NULL;
+  if (dict->ext.size < sizeof(efpak_dict_ext_t)) return NULL;
 
-static int map_file(const char* path, const uint8_t** addr, size_t* size)
+  return dict;
+}
+
+static const efpak_sparse_ext_t* get_sparse_ext(const efpak_header_t* h)
 {
-  struct stat st;
-  int fd;
-  int err = -1;
+  /* return the block extents if any and valid, NULL otherwise */
 
-  fd = open(path, O_RDONLY);
-  if (fd == -1) goto on_error_0;
+  const efpak_sparse_ext_t* sparse;
+  uint64_t data_off;
+  uint64_t off;
+  size_t size;
+  size_t i;
 
-  if (fstat(fd, &st)) goto on_error_1;
+  sparse = (const efpak_sparse_ext_t*)
+    efpak_header_find_ext(h, EFPAK_EXT_SPARSE);
+  if (sparse == NULL) return NULL;
 
-  *size = st.st_size;
-  *addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
-  if (*addr == (const uint8_t*)MAP_FAILED) goto on_error_1;
+  size = offsetof(efpak_sparse_ext_t, extents);
+  if (sparse->ext.size < size) return NULL;
+  if (sparse->count > ((sparse->ext.size - size) / sizeof(efpak_extent_t)))
+    return NULL;
 
-  err = 0;
+  /* extents data must exactly cover the block raw data */
+  data_off = 0;
+  off = 0;
+  for (i = 0; i != sparse->count; ++i)
+  {
+    const efpak_extent_t* const e = &sparse->extents[i];
+    if (e->off < off) return NULL;
+    if (e->data_off != data_off) return NULL;
+    if (e->off > sparse->size) return NULL;
+    if (e->size > (sparse->size - e->off)) return NULL;
+    off = e->off + e->size;
+    data_off += e->size;
+  }
 
- on_error_1:
-  close(fd);
- on_error_0:
-  return err;
-}
+  if (data_off != h->raw_data_size) return NULL;
 
-static void unmap_file(const uint8_t* addr, size_t size)
-{
-  munmap((void*)addr, size);
+  return sparse;
 }
 
+uint64_t efpak_header_get_size(const efpak_header_t* h)
+{
+  /* return the block contents size, holes included */
 
-/* input stream exported routines */
+  const efpak_sparse_ext_t* const sparse = get_sparse_ext(h);
+  if (sparse != NULL) return sparse->size;
+  return h->raw_data_size;
+}
 
-int efpak_istream_init_with_mem
-(efpak_istream_t* is, const uint8_t* data, size_t size)
+static size_t get_block_size(const efpak_header_t* h)
 {
-  is->data = data;
-  is->off = 0;
-  is->size = size;
-  is->header = NULL;
-  is->is_in_block = 0;
-  return 0;
+  return (size_t)(h->header_size + h->comp_data_size);
 }
 
-int efpak_istream_init_with_file
-(efpak_istream_t* is, const char* s)
+static uint32_t get_path_hash(const uint8_t* path, size_t len)
 {
-  const uint8_t* data;
-  size_t size;
+  /* fnv1a */
 
-  if (map_file(s, &data, &size)) goto on_error_0;
-  if (efpak_istream_init_with_mem(is, data, size)) goto on_error_1;
-  return 0;
+  uint32_t x = 2166136261U;
+  size_t i;
 
- on_error_1:
-  unmap_file(data, size);
- on_error_0:
-  return -1;
+  for (i = 0; i != len; ++i)
+  {
+    x ^= (uint32_t)path[i];
+    x *= 16777619U;
+  }
+
+  return x;
 }
 
-void efpak_istream_fini
-(efpak_istream_t* is)
+static uint32_t get_file_hash(const efpak_header_t* h)
 {
-  if (is->is_in_block == 1) efpak_istream_end_block(is);
-  unmap_file(is->data, is->size);
+  /* path hash of file blocks, 0 for other blocks */
+
+  if (h->type != EFPAK_BTYPE_FILE) return 0;
+  if (h->u.file.path_len == 0) return 0;
+  return get_path_hash(h->u.file.path, h->u.file.path_len - 1);
 }
 
-int efpak_istream_next_block
-(efpak_istream_t* is, const efpak_header_t** h)
+static const efpak_index_entry_t* find_index_entry
+(const efpak_index_ext_t* index, size_t off)
 {
-  /* TODO: convert header fields if local endianness is not little */
-  /* TODO: to do so, first internally allocate a header, convert */
-  /* TODO: the fields and return this allocated header. take care */
-  /* TODO: of releasing when no longer needed. */
+  /* find the last entry whose raw_off <= off */
 
-#if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
-#error "unsupported endianness"
-#endif
+  size_t lo = 0;
+  size_t hi = index->count;
+  size_t mid;
 
-  if (is->header != NULL)
+  while ((hi - lo) > 1)
   {
-    const size_t off =
-      is->off + is->header->header_size + is->header->comp_data_size;
-    if (off > is->size) return -1;
-    is->off = off;
+    mid = lo + (hi - lo) / 2;
+    if (index->entries[mid].raw_off <= (uint64_t)off) lo = mid;
+    else hi = mid;
   }
 
-  if (is->off == is->size)
-  {
-    is->header = NULL;
-    goto on_success;
-  }
+  return &index->entries[lo];
+}
 
-  is->header = (const efpak_header_t*)(is->data + is->off);
-  if ((is->off + is->header->header_size) > is->size) return -1;
 
- on_success:
-  *h = is->header;
-  return 0;
-}
+/* block memory type specific operations */
 
-int efpak_istream_start_block
-(efpak_istream_t* is)
+static int mem_next_batch
+(efpak_imem_t* mem, struct iovec* iov, size_t* count, size_t* size)
+{
+  /* a single range, as returned by next */
+
+  const uint8_t* data;
+
+  if (mem->next(mem, &data, size)) return -1;
+
+  *count = 0;
+  if (*size == 0) return 0;
+
+  iov[0].iov_base = (void*)data;
+  iov[0].iov_len = *size;
+  *count = 1;
+
+  return 0;
+}
+
+static void mem_init(efpak_imem_t* mem, const uint8_t* data, size_t size) 
+{
+  mem->data = data;
+  mem->size = size;
+  mem->off = 0;
+  mem->next_batch = mem_next_batch;
+  mem->set_obuf = NULL;
+  mem->ring_count = 0;
+}
+
+static void mem_ring_fini(efpak_imem_t* mem)
+{
+  /* give the decoder its own output buffer back */
+
+  size_t i;
+
+  if (mem->ring_count <= 1) return ;
+
+  mem->set_obuf(mem, mem->ring[0]);
+  for (i = 1; i != mem->ring_count; ++i) free(mem->ring[i]);
+  mem->ring_count = 1;
+  mem->ring_pos = 0;
+}
+
+/* streamed input. the block data is read from a file descriptor */
+/* through a bounded window, refilled once the decoder consumed it. */
+/* seekable files are mapped by windows instead of being read. */
+
+static const size_t fd_window_size = 1024 * 1024;
+
+static size_t read_full(int fd, uint8_t* buf, size_t size)
+{
+  /* read up to size bytes, short only on end of file or error */
+
+  size_t i;
+  ssize_t n;
+
+  for (i = 0; i != size; i += (size_t)n)
+  {
+    n = read(fd, buf + i, size - i);
+    if (n <= 0)
+    {
+      if (n == 0) break ;
+      if (errno != EINTR) return (size_t)-1;
+      n = 0;
+    }
+  }
+
+  return i;
+}
+
+static size_t pread_full(int fd, uint8_t* buf, size_t size, uint64_t off)
+{
+  /* read up to size bytes, short only on end of file or error */
+
+  size_t i;
+  ssize_t n;
+
+  for (i = 0; i != size; i += (size_t)n)
+  {
+    n = pread64(fd, buf + i, size - i, (off64_t)(off + i));
+    if (n <= 0)
+    {
+      if (n < 0) return (size_t)-1;
+      break ;
+    }
+  }
+
+  return i;
+}
+
+static void mem_unmap(efpak_imem_t* mem)
+{
+  if (mem->map_addr == NULL) return ;
+  munmap(mem->map_addr, mem->map_size);
+  mem->map_addr = NULL;
+}
+
+static int mem_remap(efpak_imem_t* mem, size_t* ipos)
+{
+  /* map the next window at the data not consumed at ipos */
+
+  const uint64_t page_mask = (uint64_t)sysconf(_SC_PAGESIZE) - 1;
+  const size_t n = mem->size - *ipos;
+  const uint64_t off = mem->foff - (uint64_t)n;
+  const size_t delta = (size_t)(off & page_mask);
+  size_t size;
+  void* addr;
+
+  if ((delta + n) >= mem->win_size) return -1;
+
+  size = mem->win_size - delta - n;
+  if ((uint64_t)size > mem->irem) size = (size_t)mem->irem;
+
+  mem_unmap(mem);
+
+  addr = mmap64
+    (NULL, delta + n + size, PROT_READ, MAP_SHARED, mem->fd, off - delta);
+  if (addr == MAP_FAILED)
+  {
+    PERROR();
+    return -1;
+  }
+
+  mem->map_addr = addr;
+  mem->map_size = delta + n + size;
+  mem->data = (const uint8_t*)addr + delta;
+  mem->size = n + size;
+  mem->irem -= size;
+  mem->foff += size;
+  *ipos = 0;
+
+  return 0;
+}
+
+static int mem_refill(efpak_imem_t* mem, size_t* ipos)
+{
+  /* move the window data not consumed at ipos to the front, read */
+  /* the next block data after it, and set ipos accordingly */
+
+  const size_t n = mem->size - *ipos;
+  size_t size;
+
+  if ((mem->fd == -1) || (mem->irem == 0)) return 0;
+
+  if (mem->win_size) return mem_remap(mem, ipos);
+
+  size = fd_window_size - n;
+  if ((uint64_t)size > mem->irem) size = (size_t)mem->irem;
+
+  memmove(mem->ibuf, mem->data + *ipos, n);
+  if (read_full(mem->fd, mem->ibuf + n, size) != size)
+  {
+    PERROR();
+    return -1;
+  }
+
+  mem->data = mem->ibuf;
+  mem->size = n + size;
+  mem->irem -= size;
+  mem->foff += size;
+  *ipos = 0;
+
+  return 0;
+}
+
+static int ram_mem_seek(efpak_imem_t* mem, size_t off)
+{
+  if (off > mem->size) return -1;
+  mem->off = off;
+  return 0;
+}
+
+static int ram_mem_next(efpak_imem_t* mem, const uint8_t** data, size_t* size)
+{
+  if (*size == (size_t)-1) *size = mem->size - mem->off;
+  if ((mem->off + *size) > mem->size) *size = mem->size - mem->off;
+
+  *data = mem->data + mem->off;
+  mem->off += *size;
+
+  return 0;
+}
+
+static void ram_mem_fini(efpak_imem_t* mem)
+{
+}
+
+static size_t ram_mem_get_ipos(efpak_imem_t* mem)
+{
+  return mem->off;
+}
+
+static int ram_mem_init(efpak_imem_t* mem, const uint8_t* data, size_t size)
+{
+  mem_init(mem, data, size);
+  mem->index = NULL;
+  mem->seek = ram_mem_seek;
+  mem->next = ram_mem_next;
+  mem->fini = ram_mem_fini;
+  mem->get_ipos = ram_mem_get_ipos;
+  return 0;
+}
+
+/* streamed memory. a decoder produces the block raw data by */
+/* successive output blocks, and can restart at index entries. */
+
+static int stream_mem_seek(efpak_imem_t* mem, size_t off)
+{
+  const efpak_index_entry_t* e;
+  size_t n;
+
+  if (mem->index != NULL)
+  {
+    /* restart from the closest entry if going backward */
+    /* or if it is ahead of the current position */
+
+    e = find_index_entry(mem->index, off);
+
+    if ((off < mem->off) || (e->raw_off > (mem->off + mem->oblock_size)))
+    {
+      if (mem->restart(mem, (size_t)e->comp_off)) return -1;
+
+      mem->off = (size_t)e->raw_off;
+      mem->oblock_data = NULL;
+      mem->oblock_size = 0;
+    }
+  }
+  else if (mem->rewind != NULL)
+  {
+    if (mem->rewind(mem, off)) return -1;
+  }
+
+  /* cannot go backward without index nor access point */
+  if (off < mem->off) return -1;
+
+  if ((mem->off + mem->oblock_size) <= off)
+  {
+    while (1)
+    {
+      mem->off += mem->oblock_size;
+
+      if (mem->next_oblock(mem, &mem->oblock_data, &mem->oblock_size))
+	return -1;
+
+      if (mem->oblock_size == 0)
+	return -1;
+
+      if ((mem->off + mem->oblock_size) > off)
+	break ;
+    }
+  }
+
+  n = off - mem->off;
+  mem->oblock_data += n;
+  mem->oblock_size -= n;
+  mem->off += n;
+
+  return 0;
+}
+
+static int stream_mem_next
+(efpak_imem_t* mem, const uint8_t** buf, size_t* size)
+{
+  if (mem->oblock_size == 0)
+  {
+    if (mem->next_oblock(mem, &mem->oblock_data, &mem->oblock_size))
+      return -1;
+  }
+
+  /* note: keep both condition for readability */
+  if ((*size == (size_t)-1) || (*size > mem->oblock_size))
+  {
+    *size = mem->oblock_size;
+  }
+
+  *buf = mem->oblock_data;
+
+  mem->off += *size;
+  mem->oblock_data += *size;
+  mem->oblock_size -= *size;
+
+  return 0;
+}
+
+static int stream_mem_next_batch
+(efpak_imem_t* mem, struct iovec* iov, size_t* count, size_t* size)
+{
+  /* the current output block rest, then output blocks decoded in */
+  /* the next ring buffers, while the previous ones are returned */
+
+  size_t i;
+  size_t j;
+  size_t n;
+
+  if (mem->ring_count == 1)
+  {
+    for (; mem->ring_count != EFPAK_IMEM_RING_SIZE; ++mem->ring_count)
+    {
+      mem->ring[mem->ring_count] = malloc(mem->ring_osize);
+      if (mem->ring[mem->ring_count] == NULL) break ;
+    }
+  }
+
+  if (mem->ring_count <= 1) return mem_next_batch(mem, iov, count, size);
+
+  for (i = 0, j = 0; (i != *count) && (j != *size); ++i, j += n)
+  {
+    if (mem->oblock_size == 0)
+    {
+      if (i)
+      {
+	if (i == mem->ring_count) break ;
+	mem->ring_pos = (mem->ring_pos + 1) % mem->ring_count;
+	mem->set_obuf(mem, mem->ring[mem->ring_pos]);
+      }
+
+      if (mem->next_oblock(mem, &mem->oblock_data, &mem->oblock_size))
+	return -1;
+
+      if (mem->oblock_size == 0) break ;
+    }
+
+    n = *size - j;
+    if (n > mem->oblock_size) n = mem->oblock_size;
+
+    iov[i].iov_base = (void*)mem->oblock_data;
+    iov[i].iov_len = n;
+
+    mem->off += n;
+    mem->oblock_data += n;
+    mem->oblock_size -= n;
+  }
+
+  *count = i;
+  *size = j;
+
+  return 0;
+}
+
+static void stream_mem_set_ring
+(
+ efpak_imem_t* mem,
+ void (*set_obuf)(efpak_imem_t*, uint8_t*),
+ uint8_t* obuf, size_t osize
+)
+{
+  /* decoders whose output buffer can be redirected */
+
+  mem->next_batch = stream_mem_next_batch;
+  mem->set_obuf = set_obuf;
+  mem->ring[0] = obuf;
+  mem->ring_count = 1;
+  mem->ring_pos = 0;
+  mem->ring_osize = osize;
+}
+
+#if defined(CONFIG_ZSTD) || defined(CONFIG_LZ4) || defined(CONFIG_XZ)
+
+static void decoder_mem_set_obuf(efpak_imem_t* mem, uint8_t* obuf)
+{
+  mem->decoder.obuf = obuf;
+}
+
+#endif /* CONFIG_ZSTD || CONFIG_LZ4 || CONFIG_XZ */
+
+static size_t stream_mem_get_ipos(efpak_imem_t* mem)
+{
+  /* library decoders position, overriden by others */
+  return mem->decoder.ipos;
+}
+
+static void stream_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  mem_init(mem, data, size);
+  mem->seek = stream_mem_seek;
+  mem->next = stream_mem_next;
+  mem->get_ipos = stream_mem_get_ipos;
+
+  mem->oblock_data = NULL;
+  mem->oblock_size = 0;
+
+  mem->index = index;
+  mem->rewind = NULL;
+}
+
+
+/* streamed uncompressed memory, output blocks are the windows. */
+/* they are sector multiples from the block data start, the window */
+/* remainder being carried to the next one, since installs write */
+/* whole sectors. only the last output block may be partial. */
+
+static const size_t window_oblock_align = 512;
+
+static int window_mem_next_oblock
+(efpak_imem_t* mem, const uint8_t** obufp, size_t* osizep)
+{
+  efpak_decoder_t* const w = &mem->decoder;
+  size_t n;
+
+  while (1)
+  {
+    n = mem->size - w->ipos;
+    if (mem->irem == 0) break ;
+
+    n &= ~(window_oblock_align - 1);
+    if (n) break ;
+
+    if (mem_refill(mem, &w->ipos)) return -1;
+  }
+
+  *obufp = mem->data + w->ipos;
+  *osizep = n;
+  w->ipos += n;
+
+  return 0;
+}
+
+static int window_mem_init
+(efpak_imem_t* mem, const uint8_t* data, size_t size)
+{
+  mem->decoder.ipos = 0;
+
+  /* without index, streamed data are never restarted. nothing is */
+  /* held but the windows, as for ram memories. */
+  stream_mem_init(mem, data, size, NULL);
+  mem->next_oblock = window_mem_next_oblock;
+  mem->restart = NULL;
+  mem->fini = ram_mem_fini;
+
+  return 0;
+}
+
+
+/* zlib memory */
+
+static int inflate_mem_next_oblock
+(efpak_imem_t* mem, const uint8_t** obufp, size_t* osizep)
+{
+  efpak_inflate_t* const infl = &mem->inflate;
+  size_t ipos;
+
+  while (1)
+  {
+    if (inflate_next_oblock(infl, obufp, osizep)) return -1;
+    if (*obufp != NULL) break ;
+
+    /* streamed input consumed, read more or end the input */
+    if ((mem->irem == 0) || (infl->flags & EFPAK_INFLATE_FLAG_EOS))
+    {
+      inflate_set_eoi(infl);
+      continue ;
+    }
+
+    ipos = mem->size - (size_t)infl->z.avail_in;
+    if (mem_refill(mem, &ipos)) return -1;
+    inflate_add_iblock(infl, (uint8_t*)mem->data + ipos, mem->size - ipos);
+  }
+
+  return 0;
+}
+
+static int inflate_mem_restart(efpak_imem_t* mem, size_t off)
+{
+  /* index entries are raw deflate streams */
+
+  const uint8_t* const data = mem->data + off;
+  const size_t size = mem->size - off;
+
+  return inflate_restart(&mem->inflate, data, size, -MAX_WBITS);
+}
+
+static int inflate_mem_rewind(efpak_imem_t* mem, size_t off)
+{
+  /* restart from the last access point before off, or from the */
+  /* block start, unless decoding forward from the current output */
+  /* block is closer */
+
+  efpak_inflate_t* const infl = &mem->inflate;
+  const efpak_inflate_point_t* p = NULL;
+  size_t lo = 0;
+  size_t hi = infl->point_count;
+  size_t mid;
+  size_t raw_off;
+  const uint8_t* data;
+
+  while (lo != hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (infl->points[mid].raw_off <= (uint64_t)off) lo = mid + 1;
+    else hi = mid;
+  }
+
+  if (lo) p = &infl->points[lo - 1];
+  raw_off = (p != NULL) ? (size_t)p->raw_off : 0;
+
+  if ((off >= mem->off) && (raw_off <= (mem->off + mem->oblock_size)))
+    return 0;
+
+  if (p == NULL)
+  {
+    if (inflate_restart(infl, mem->data, mem->size, 16 + MAX_WBITS))
+      return -1;
+  }
+  else
+  {
+    z_stream* const z = &infl->z;
+
+    data = mem->data + p->comp_off;
+    if (inflate_restart(infl, data, mem->size - p->comp_off, -MAX_WBITS))
+      return -1;
+
+    /* the previous byte bits not consumed */
+    if (p->bits)
+    {
+      if (inflatePrime(z, p->bits, data[-1] >> (8 - p->bits)) != Z_OK)
+	return -1;
+    }
+
+    if (inflateSetDictionary(z, p->window, (uInt)p->window_size) != Z_OK)
+      return -1;
+  }
+
+  infl->raw_base = (uint64_t)raw_off;
+
+  mem->off = raw_off;
+  mem->oblock_data = NULL;
+  mem->oblock_size = 0;
+
+  return 0;
+}
+
+static void inflate_mem_set_obuf(efpak_imem_t* mem, uint8_t* obuf)
+{
+  /* between output blocks, the whole buffer is free */
+
+  efpak_inflate_t* const infl = &mem->inflate;
+
+  infl->obuf = obuf;
+  infl->z.next_out = obuf;
+  infl->z.avail_out = (uInt)infl->osize;
+}
+
+static void inflate_mem_fini(efpak_imem_t* mem)
+{
+  /* the context is kept for the next zlib block */
+  mem->has_inflate = 1;
+}
+
+static size_t inflate_mem_get_ipos(efpak_imem_t* mem)
+{
+  const z_stream* const z = &mem->inflate.z;
+  if (z->next_in == Z_NULL) return 0;
+  return (size_t)((const uint8_t*)z->next_in - mem->data);
+}
+
+/* ASSUME((oblock_size % DISK_BLOCK_SIZE) == 0) */
+static const size_t inflate_oblock_size = 64 * 1024;
+
+static int inflate_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  /* reuse the context of a previous block if any */
+  if (mem->has_inflate)
+  {
+    mem->has_inflate = 0;
+    if (inflate_reset(&mem->inflate)) goto on_error_1;
+  }
+  else if (inflate_init(&mem->inflate, inflate_oblock_size))
+  {
+    goto on_error_0;
+  }
+
+  if (inflate_add_iblock(&mem->inflate, (void*)data, size))
+    goto on_error_1;
+
+  /* streamed input ends once the whole block data is read */
+  if (mem->irem == 0) inflate_set_eoi(&mem->inflate);
+
+  stream_mem_init(mem, data, size, index);
+  mem->next_oblock = inflate_mem_next_oblock;
+  mem->restart = inflate_mem_restart;
+  mem->fini = inflate_mem_fini;
+  mem->get_ipos = inflate_mem_get_ipos;
+  stream_mem_set_ring
+    (mem, inflate_mem_set_obuf, mem->inflate.obuf, mem->inflate.osize);
+
+  /* without index, rewind to access points recorded on the way */
+  if ((index == NULL) && (mem->fd == -1))
+  {
+    efpak_inflate_t* const infl = &mem->inflate;
+    infl->ibase = data;
+    infl->point_span = mem->point_span;
+    infl->point_max = mem->point_mem_size / sizeof(efpak_inflate_point_t);
+    if (infl->point_max < 2) infl->point_span = 0;
+    mem->rewind = inflate_mem_rewind;
+  }
+
+  return 0;
+
+ on_error_1:
+  inflate_fini(&mem->inflate);
+ on_error_0:
+  return -1;
+}
+
+
+#ifdef CONFIG_ZSTD
+
+/* zstd memory */
+
+static int zstd_mem_next_oblock
+(efpak_imem_t* mem, const uint8_t** obufp, size_t* osizep)
+{
+  efpak_decoder_t* const zs = &mem->decoder;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t in_pos;
+  size_t out_pos;
+  size_t err;
+
+  in.src = mem->data;
+  in.size = mem->size;
+  in.pos = zs->ipos;
+
+  out.dst = zs->obuf;
+  out.size = zs->osize;
+  out.pos = 0;
+
+  /* decode until the output is full or no progress is possible */
+  while (out.pos != out.size)
+  {
+    in_pos = in.pos;
+    out_pos = out.pos;
+
+    err = ZSTD_decompressStream(zs->dctx, &out, &in);
+    if (ZSTD_isError(err))
+    {
+      PERROR();
+      return -1;
+    }
+
+    if ((in.pos == in_pos) && (out.pos == out_pos))
+    {
+      /* read more streamed input once the window is consumed */
+      if ((in.pos != in.size) || (mem->irem == 0)) break ;
+      if (mem_refill(mem, &in.pos)) return -1;
+      in.src = mem->data;
+      in.size = mem->size;
+      continue ;
+    }
+
+    /* zero once a frame is fully decoded and flushed */
+    zs->hint = err;
+  }
+
+  /* input exhausted in the middle of a frame */
+  if ((out.pos == 0) && (in.pos == in.size) && zs->hint)
+  {
+    PERROR();
+    return -1;
+  }
+
+  zs->ipos = in.pos;
+
+  *obufp = zs->obuf;
+  *osizep = out.pos;
+
+  return 0;
+}
+
+static int zstd_mem_restart(efpak_imem_t* mem, size_t off)
+{
+  /* index entries are frame starts */
+
+  efpak_decoder_t* const zs = &mem->decoder;
+
+  if (ZSTD_isError(ZSTD_DCtx_reset(zs->dctx, ZSTD_reset_session_only)))
+    return -1;
+
+  zs->ipos = off;
+  zs->hint = 0;
+
+  return 0;
+}
+
+static void zstd_mem_fini(efpak_imem_t* mem)
+{
+  ZSTD_freeDCtx(mem->decoder.dctx);
+  free(mem->decoder.obuf);
+}
+
+static int zstd_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  efpak_decoder_t* const zs = &mem->decoder;
+
+  zs->osize = inflate_oblock_size;
+  zs->obuf = malloc(zs->osize);
+  if (zs->obuf == NULL) goto on_error_0;
+
+  zs->dctx = ZSTD_createDCtx();
+  if (zs->dctx == NULL) goto on_error_1;
+
+  zs->ipos = 0;
+  zs->hint = 0;
+
+  stream_mem_init(mem, data, size, index);
+  mem->next_oblock = zstd_mem_next_oblock;
+  mem->restart = zstd_mem_restart;
+  mem->fini = zstd_mem_fini;
+  stream_mem_set_ring
+    (mem, decoder_mem_set_obuf, mem->decoder.obuf, mem->decoder.osize);
+
+  return 0;
+
+ on_error_1:
+  free(zs->obuf);
+ on_error_0:
+  return -1;
+}
+
+#endif /* CONFIG_ZSTD */
+
+
+#ifdef CONFIG_LZ4
+
+/* lz4 memory */
+
+static int lz4_mem_next_oblock
+(efpak_imem_t* mem, const uint8_t** obufp, size_t* osizep)
+{
+  efpak_decoder_t* const lz = &mem->decoder;
+  size_t opos = 0;
+  size_t isize;
+  size_t osize;
+  size_t err;
+
+  /* decode until the output is full or no progress is possible */
+  while (opos != lz->osize)
+  {
+    isize = mem->size - lz->ipos;
+    osize = lz->osize - opos;
+
+    err = LZ4F_decompress
+    (
+     lz->dctx,
+     lz->obuf + opos, &osize,
+     mem->data + lz->ipos, &isize,
+     NULL
+    );
+
+    if (LZ4F_isError(err))
+    {
+      PERROR();
+      return -1;
+    }
+
+    if ((isize == 0) && (osize == 0))
+    {
+      /* read more streamed input once the window is consumed */
+      if ((lz->ipos != mem->size) || (mem->irem == 0)) break ;
+      if (mem_refill(mem, &lz->ipos)) return -1;
+      continue ;
+    }
+
+    lz->ipos += isize;
+    opos += osize;
+
+    /* zero once a frame is fully decoded and flushed */
+    lz->hint = err;
+  }
+
+  /* input exhausted in the middle of a frame */
+  if ((opos == 0) && (lz->ipos == mem->size) && lz->hint)
+  {
+    PERROR();
+    return -1;
+  }
+
+  *obufp = lz->obuf;
+  *osizep = opos;
+
+  return 0;
+}
+
+static int lz4_mem_restart(efpak_imem_t* mem, size_t off)
+{
+  /* index entries are frame starts */
+
+  efpak_decoder_t* const lz = &mem->decoder;
+
+  LZ4F_resetDecompressionContext(lz->dctx);
+  lz->ipos = off;
+  lz->hint = 0;
+
+  return 0;
+}
+
+static void lz4_mem_fini(efpak_imem_t* mem)
+{
+  LZ4F_freeDecompressionContext(mem->decoder.dctx);
+  free(mem->decoder.obuf);
+}
+
+static int lz4_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  efpak_decoder_t* const lz = &mem->decoder;
+  LZ4F_dctx* dctx;
+
+  lz->osize = inflate_oblock_size;
+  lz->obuf = malloc(lz->osize);
+  if (lz->obuf == NULL) goto on_error_0;
+
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+    goto on_error_1;
+
+  lz->dctx = dctx;
+  lz->ipos = 0;
+  lz->hint = 0;
+
+  stream_mem_init(mem, data, size, index);
+  mem->next_oblock = lz4_mem_next_oblock;
+  mem->restart = lz4_mem_restart;
+  mem->fini = lz4_mem_fini;
+  stream_mem_set_ring
+    (mem, decoder_mem_set_obuf, mem->decoder.obuf, mem->decoder.osize);
+
+  return 0;
+
+ on_error_1:
+  free(lz->obuf);
+ on_error_0:
+  return -1;
+}
+
+#endif /* CONFIG_LZ4 */
+
+
+#ifdef CONFIG_XZ
+
+/* xz memory */
+
+static const lzma_stream xz_stream_init = LZMA_STREAM_INIT;
+
+static int xz_mem_next_oblock
+(efpak_imem_t* mem, const uint8_t** obufp, size_t* osizep)
+{
+  efpak_decoder_t* const xz = &mem->decoder;
+  lzma_stream* const strm = xz->dctx;
+  lzma_ret err;
+
+  *obufp = xz->obuf;
+  *osizep = 0;
+
+  /* last stream already ended */
+  if (xz->hint == 0) return 0;
+
+  strm->next_out = xz->obuf;
+  strm->avail_out = xz->osize;
+
+  while ((strm->avail_out != 0) && xz->hint)
+  {
+    /* read more streamed input once the window is consumed */
+    if (xz->ipos == mem->size)
+    {
+      if (mem_refill(mem, &xz->ipos)) return -1;
+    }
+
+    strm->next_in = mem->data + xz->ipos;
+    strm->avail_in = mem->size - xz->ipos;
+
+    /* once the whole input is available, finish decoding it */
+    err = lzma_code(strm, mem->irem ? LZMA_RUN : LZMA_FINISH);
+    xz->ipos = mem->size - strm->avail_in;
+
+    if (err == LZMA_STREAM_END) xz->hint = 0;
+    else if (err != LZMA_OK)
+    {
+      PERROR();
+      return -1;
+    }
+
+    if (mem->irem == 0) break ;
+  }
+
+  *osizep = xz->osize - strm->avail_out;
+
+  return 0;
+}
+
+static int xz_mem_restart(efpak_imem_t* mem, size_t off)
+{
+  /* index entries are stream starts */
+
+  efpak_decoder_t* const xz = &mem->decoder;
+
+  if (lzma_stream_decoder(xz->dctx, UINT64_MAX, LZMA_CONCATENATED))
+    return -1;
+
+  xz->ipos = off;
+  xz->hint = 1;
+
+  return 0;
+}
+
+static void xz_mem_fini(efpak_imem_t* mem)
+{
+  lzma_end(mem->decoder.dctx);
+  free(mem->decoder.dctx);
+  free(mem->decoder.obuf);
+}
+
+static int xz_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  efpak_decoder_t* const xz = &mem->decoder;
+  lzma_stream* strm;
+
+  xz->osize = inflate_oblock_size;
+  xz->obuf = malloc(xz->osize);
+  if (xz->obuf == NULL) goto on_error_0;
+
+  strm = malloc(sizeof(lzma_stream));
+  if (strm == NULL) goto on_error_1;
+  *strm = xz_stream_init;
+
+  xz->dctx = strm;
+  if (xz_mem_restart(mem, 0)) goto on_error_2;
+
+  stream_mem_init(mem, data, size, index);
+  mem->next_oblock = xz_mem_next_oblock;
+  mem->restart = xz_mem_restart;
+  mem->fini = xz_mem_fini;
+  stream_mem_set_ring
+    (mem, decoder_mem_set_obuf, mem->decoder.obuf, mem->decoder.osize);
+
+  return 0;
+
+ on_error_2:
+  lzma_end(strm);
+  free(strm);
+ on_error_1:
+  free(xz->obuf);
+ on_error_0:
+  return -1;
+}
+
+#endif /* CONFIG_XZ */
+
+
+static int codec_mem_init
+(
+ efpak_imem_t* mem,
+ efpak_bcomp_t comp,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index
+)
+{
+  /* sequential decoding memory for compressed blocks */
+
+  switch (comp)
+  {
+  case EFPAK_BCOMP_ZLIB:
+    return inflate_mem_init(mem, data, size, index);
+    break ;
+
+#ifdef CONFIG_ZSTD
+  case EFPAK_BCOMP_ZSTD:
+    return zstd_mem_init(mem, data, size, index);
+    break ;
+#endif /* CONFIG_ZSTD */
+
+#ifdef CONFIG_LZ4
+  case EFPAK_BCOMP_LZ4:
+    return lz4_mem_init(mem, data, size, index);
+    break ;
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_XZ
+  case EFPAK_BCOMP_XZ:
+    return xz_mem_init(mem, data, size, index);
+    break ;
+#endif /* CONFIG_XZ */
+
+  default:
+    PERROR();
+    break ;
+  }
+
+  return -1;
+}
+
+
+/* one shot zlib memory. blocks small enough are decoded whole in */
+/* a buffer, with libdeflate if available, then read as ram memory. */
+
+static int oneshot_decode
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ uint8_t* obuf, size_t osize
+)
+{
+#ifdef CONFIG_LIBDEFLATE
+
+  /* the decompressor is kept for the next blocks */
+
+  size_t isize;
+  size_t n;
+
+  if (mem->oneshot_dctx == NULL)
+  {
+    mem->oneshot_dctx = libdeflate_alloc_decompressor();
+    if (mem->oneshot_dctx == NULL) return -1;
+  }
+
+  /* trailing input is ignored, as by the streaming decoder */
+  if (libdeflate_gzip_decompress_ex
+      (mem->oneshot_dctx, data, size, obuf, osize, &isize, &n)
+      != LIBDEFLATE_SUCCESS)
+    return -1;
+
+  if (n != osize) return -1;
+
+  return 0;
+
+#else
+
+  /* a single zlib call, with the block memory context */
+
+  efpak_inflate_t* const infl = &mem->inflate;
+  z_stream* const z = &infl->z;
+
+  if (mem->has_inflate == 0)
+  {
+    if (inflate_init(infl, inflate_oblock_size)) return -1;
+    mem->has_inflate = 1;
+  }
+  else if (inflate_reset(infl))
+  {
+    return -1;
+  }
+
+  z->next_in = (Bytef*)data;
+  z->avail_in = (uInt)size;
+  z->next_out = (Bytef*)obuf;
+  z->avail_out = (uInt)osize;
+
+  if (inflate(z, Z_FINISH) != Z_STREAM_END) return -1;
+  if (z->avail_out) return -1;
+
+  return 0;
+
+#endif /* CONFIG_LIBDEFLATE */
+}
+
+static void oneshot_mem_fini(efpak_imem_t* mem)
+{
+  free((void*)mem->data);
+}
+
+static int oneshot_mem_init
+(
+ efpak_imem_t* mem,
+ const uint8_t* data, size_t size,
+ size_t raw_size
+)
+{
+  uint8_t* buf;
+
+  if ((raw_size == 0) || (raw_size > (size_t)UINT32_MAX)) goto on_error_0;
+  if (size > (size_t)UINT32_MAX) goto on_error_0;
+
+  buf = malloc(raw_size);
+  if (buf == NULL) goto on_error_0;
+
+  if (oneshot_decode(mem, data, size, buf, raw_size)) goto on_error_1;
+
+  ram_mem_init(mem, buf, raw_size);
+  mem->fini = oneshot_mem_fini;
+
+  /* the whole input is consumed */
+  mem->decoder.ipos = size;
+  mem->get_ipos = stream_mem_get_ipos;
+
+  return 0;
+
+ on_error_1:
+  free(buf);
+ on_error_0:
+  return -1;
+}
+
+
+/* parallel memory. the block spans delimited by its chunk index */
+/* are decoded by batch on the istream worker pool. */
+
+static int pinflate_span_zlib
+(efpak_pinflate_slot_t* slot, const uint8_t* data, size_t size)
+{
+  z_stream* const z = &slot->z;
+  int err;
+
+  if (inflateReset2(z, -MAX_WBITS) != Z_OK) return -1;
+
+  z->next_in = (Bytef*)data;
+  z->avail_in = (uInt)size;
+  z->next_out = (Bytef*)slot->obuf;
+  z->avail_out = (uInt)slot->osize;
+
+  err = inflate(z, Z_SYNC_FLUSH);
+  if ((err != Z_OK) && (err != Z_STREAM_END) && (err != Z_BUF_ERROR))
+    return -1;
+  if (z->avail_out) return -1;
+
+  /* raw deflate spans have no check of their own */
+  slot->crc = crc32(crc32(0, Z_NULL, 0), slot->obuf, (uInt)slot->osize);
+
+  return 0;
+}
+
+#ifdef CONFIG_ZSTD
+
+static int pinflate_span_zstd
+(efpak_pinflate_slot_t* slot, const uint8_t* data, size_t size)
+{
+  const size_t n = ZSTD_decompressDCtx
+    (slot->ctx, slot->obuf, slot->osize, data, size);
+  if (ZSTD_isError(n) || (n != slot->osize)) return -1;
+  return 0;
+}
+
+#endif /* CONFIG_ZSTD */
+
+#ifdef CONFIG_LZ4
+
+static int pinflate_span_lz4
+(efpak_pinflate_slot_t* slot, const uint8_t* data, size_t size)
+{
+  size_t isize = size;
+  size_t osize = slot->osize;
+  size_t err;
+
+  LZ4F_resetDecompressionContext(slot->ctx);
+
+  err = LZ4F_decompress(slot->ctx, slot->obuf, &osize, data, &isize, NULL);
+  if (LZ4F_isError(err) || err || (osize != slot->osize)) return -1;
+
+  return 0;
+}
+
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_XZ
+
+static int pinflate_span_xz
+(efpak_pinflate_slot_t* slot, const uint8_t* data, size_t size)
+{
+  lzma_stream* const strm = slot->ctx;
+
+  if (lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED)) return -1;
+
+  strm->next_in = data;
+  strm->avail_in = size;
+  strm->next_out = slot->obuf;
+  strm->avail_out = slot->osize;
+
+  if (lzma_code(strm, LZMA_FINISH) != LZMA_STREAM_END) return -1;
+  if (strm->avail_out) return -1;
+
+  return 0;
+}
+
+#endif /* CONFIG_XZ */
+
+static void pinflate_span(void* arg, size_t i)
+{
+  efpak_imem_t* const mem = arg;
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  efpak_pinflate_slot_t* const slot = &pinfl->slots[i];
+  const efpak_index_ext_t* const index = mem->index;
+  const size_t k = pinfl->batch_entry + i;
+  const size_t comp_off = (size_t)index->entries[k].comp_off;
+  size_t comp_end;
+  size_t raw_end;
+
+  if ((k + 1) == (size_t)index->count)
+  {
+    comp_end = mem->size;
+    raw_end = pinfl->raw_size;
+  }
+  else
+  {
+    comp_end = (size_t)index->entries[k + 1].comp_off;
+    raw_end = (size_t)index->entries[k + 1].raw_off;
+  }
+
+  slot->osize = raw_end - (size_t)index->entries[k].raw_off;
+
+  switch (pinfl->comp)
+  {
+  case EFPAK_BCOMP_ZLIB:
+    slot->err = pinflate_span_zlib
+      (slot, mem->data + comp_off, comp_end - comp_off);
+    break ;
+
+#ifdef CONFIG_ZSTD
+  case EFPAK_BCOMP_ZSTD:
+    slot->err = pinflate_span_zstd
+      (slot, mem->data + comp_off, comp_end - comp_off);
+    break ;
+#endif /* CONFIG_ZSTD */
+
+#ifdef CONFIG_LZ4
+  case EFPAK_BCOMP_LZ4:
+    slot->err = pinflate_span_lz4
+      (slot, mem->data + comp_off, comp_end - comp_off);
+    break ;
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_XZ
+  case EFPAK_BCOMP_XZ:
+    slot->err = pinflate_span_xz
+      (slot, mem->data + comp_off, comp_end - comp_off);
+    break ;
+#endif /* CONFIG_XZ */
+
+  default:
+    slot->err = -1;
+    break ;
+  }
+}
+
+static int pinflate_check_crc(efpak_imem_t* mem)
+{
+  /* fold the decoded batch spans crc32 if they follow the ones */
+  /* already folded, and check the gzip trailer once all are. spans */
+  /* skipped by a forward seek leave the block unchecked. */
+
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  const efpak_pinflate_slot_t* slot;
+  const uint8_t* trailer;
+  uint32_t crc;
+  uint32_t isize;
+  size_t i;
+
+  if (pinfl->comp != EFPAK_BCOMP_ZLIB) return 0;
+  if (pinfl->batch_entry != pinfl->crc_entry) return 0;
+
+  for (i = 0; i != pinfl->batch_count; ++i)
+  {
+    slot = &pinfl->slots[i];
+    pinfl->crc = crc32_combine(pinfl->crc, slot->crc, (z_off_t)slot->osize);
+  }
+
+  pinfl->crc_entry += pinfl->batch_count;
+  if (pinfl->crc_entry != (size_t)mem->index->count) return 0;
+
+  if (mem->size < 8) return -1;
+  trailer = mem->data + mem->size - 8;
+
+  crc = 0;
+  isize = 0;
+  for (i = 0; i != 4; ++i) crc |= (uint32_t)trailer[0 + i] << (i * 8);
+  for (i = 0; i != 4; ++i) isize |= (uint32_t)trailer[4 + i] << (i * 8);
+
+  if ((uint32_t)pinfl->crc != crc) return -1;
+  if ((uint32_t)pinfl->raw_size != isize) return -1;
+
+  return 0;
+}
+
+static int pinflate_decode(efpak_imem_t* mem, size_t k)
+{
+  /* decode the batch starting at index entry k */
+
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  size_t n;
+  size_t i;
+
+  n = (size_t)mem->index->count - k;
+  if (n > pinfl->slot_count) n = pinfl->slot_count;
+
+  pinfl->batch_entry = k;
+  pinfl->batch_count = n;
+  pinfl->slot_pos = 0;
+  pinfl->slot_off = 0;
+
+  pool_run(pinfl->pool, pinflate_span, mem, n);
+
+  for (i = 0; i != n; ++i)
+  {
+    if (pinfl->slots[i].err)
+    {
+      PERROR();
+      pinfl->batch_count = 0;
+      return -1;
+    }
+  }
+
+  if (pinflate_check_crc(mem))
+  {
+    PERROR();
+    pinfl->batch_count = 0;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int pinflate_mem_seek(efpak_imem_t* mem, size_t off)
+{
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  const efpak_index_entry_t* e;
+  size_t k;
+
+  if (off > pinfl->raw_size) return -1;
+
+  if (off == pinfl->raw_size)
+  {
+    /* end of block, nothing more to decode */
+    pinfl->batch_entry = (size_t)mem->index->count;
+    pinfl->batch_count = 0;
+    mem->off = off;
+    return 0;
+  }
+
+  e = find_index_entry(mem->index, off);
+  k = (size_t)(e - mem->index->entries);
+
+  /* decode only if not in the current batch */
+  if ((k < pinfl->batch_entry) ||
+      (k >= (pinfl->batch_entry + pinfl->batch_count)))
+  {
+    if (pinflate_decode(mem, k)) return -1;
+  }
+
+  pinfl->slot_pos = k - pinfl->batch_entry;
+  pinfl->slot_off = off - (size_t)e->raw_off;
+  mem->off = off;
+
+  return 0;
+}
+
+static int pinflate_mem_next
+(efpak_imem_t* mem, const uint8_t** buf, size_t* size)
+{
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  efpak_pinflate_slot_t* slot;
+  size_t n;
+
+  /* skip exhausted slots, decode the next batch if needed */
+  while (1)
+  {
+    if (pinfl->slot_pos == pinfl->batch_count)
+    {
+      const size_t k = pinfl->batch_entry + pinfl->batch_count;
+
+      if (k == (size_t)mem->index->count)
+      {
+	*size = 0;
+	return 0;
+      }
+
+      if (pinflate_decode(mem, k)) return -1;
+    }
+
+    slot = &pinfl->slots[pinfl->slot_pos];
+    if (pinfl->slot_off != slot->osize) break ;
+
+    ++pinfl->slot_pos;
+    pinfl->slot_off = 0;
+  }
+
+  n = slot->osize - pinfl->slot_off;
+  if ((*size == (size_t)-1) || (*size > n)) *size = n;
+
+  *buf = slot->obuf + pinfl->slot_off;
+
+  pinfl->slot_off += *size;
+  mem->off += *size;
+
+  return 0;
+}
+
+static int pinflate_mem_next_batch
+(efpak_imem_t* mem, struct iovec* iov, size_t* count, size_t* size)
+{
+  /* the decoded spans of the current batch, the next batch being */
+  /* decoded only if it is exhausted */
+
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  const uint8_t* data;
+  size_t i;
+  size_t j;
+  size_t n;
+
+  for (i = 0, j = 0; (i != *count) && (j != *size); ++i, j += n)
+  {
+    while (pinfl->slot_pos != pinfl->batch_count)
+    {
+      if (pinfl->slot_off != pinfl->slots[pinfl->slot_pos].osize) break ;
+      ++pinfl->slot_pos;
+      pinfl->slot_off = 0;
+    }
+
+    if (i && (pinfl->slot_pos == pinfl->batch_count)) break ;
+
+    n = *size - j;
+    if (pinflate_mem_next(mem, &data, &n)) return -1;
+    if (n == 0) break ;
+
+    iov[i].iov_base = (void*)data;
+    iov[i].iov_len = n;
+  }
+
+  *count = i;
+  *size = j;
+
+  return 0;
+}
+
+static int pinflate_slot_init
+(efpak_pinflate_t* pinfl, efpak_pinflate_slot_t* slot)
+{
+  switch (pinfl->comp)
+  {
+  case EFPAK_BCOMP_ZLIB:
+    slot->z.zalloc = Z_NULL;
+    slot->z.zfree = Z_NULL;
+    slot->z.opaque = Z_NULL;
+    slot->z.next_in = Z_NULL;
+    slot->z.avail_in = 0;
+    if (inflateInit2(&slot->z, -MAX_WBITS) != Z_OK) return -1;
+    break ;
+
+#ifdef CONFIG_ZSTD
+  case EFPAK_BCOMP_ZSTD:
+    slot->ctx = ZSTD_createDCtx();
+    if (slot->ctx == NULL) return -1;
+    break ;
+#endif /* CONFIG_ZSTD */
+
+#ifdef CONFIG_LZ4
+  case EFPAK_BCOMP_LZ4:
+    {
+      LZ4F_dctx* dctx;
+      if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+	return -1;
+      slot->ctx = dctx;
+      break ;
+    }
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_XZ
+  case EFPAK_BCOMP_XZ:
+    slot->ctx = malloc(sizeof(lzma_stream));
+    if (slot->ctx == NULL) return -1;
+    *(lzma_stream*)slot->ctx = xz_stream_init;
+    break ;
+#endif /* CONFIG_XZ */
+
+  default:
+    return -1;
+    break ;
+  }
+
+  return 0;
+}
+
+static void pinflate_slot_fini
+(efpak_pinflate_t* pinfl, efpak_pinflate_slot_t* slot)
+{
+  switch (pinfl->comp)
+  {
+  case EFPAK_BCOMP_ZLIB:
+    inflateEnd(&slot->z);
+    break ;
+
+#ifdef CONFIG_ZSTD
+  case EFPAK_BCOMP_ZSTD:
+    ZSTD_freeDCtx(slot->ctx);
+    break ;
+#endif /* CONFIG_ZSTD */
+
+#ifdef CONFIG_LZ4
+  case EFPAK_BCOMP_LZ4:
+    LZ4F_freeDecompressionContext(slot->ctx);
+    break ;
+#endif /* CONFIG_LZ4 */
+
+#ifdef CONFIG_XZ
+  case EFPAK_BCOMP_XZ:
+    lzma_end(slot->ctx);
+    free(slot->ctx);
+    break ;
+#endif /* CONFIG_XZ */
+
+  default:
+    break ;
+  }
+}
+
+static void pinflate_mem_free(efpak_pinflate_t* pinfl, size_t n)
+{
+  /* n the count of initialized slots */
+
+  size_t i;
+
+  for (i = 0; i != n; ++i)
+  {
+    pinflate_slot_fini(pinfl, &pinfl->slots[i]);
+    free(pinfl->slots[i].obuf);
+  }
+
+  free(pinfl->slots);
+}
+
+static void pinflate_mem_fini(efpak_imem_t* mem)
+{
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  pinflate_mem_free(pinfl, pinfl->slot_count);
+}
+
+static size_t pinflate_mem_get_ipos(efpak_imem_t* mem)
+{
+  /* the spans of decoded batches are consumed */
+
+  const efpak_pinflate_t* const pinfl = &mem->pinflate;
+  const size_t k = pinfl->batch_entry + pinfl->batch_count;
+
+  if (k == (size_t)mem->index->count) return mem->size;
+  return (size_t)mem->index->entries[k].comp_off;
+}
+
+/* spans larger than this are not decoded in parallel */
+static const size_t pinflate_max_span_size = 16 * 1024 * 1024;
+
+static int pinflate_mem_init
+(
+ efpak_imem_t* mem,
+ efpak_bcomp_t comp,
+ const uint8_t* data, size_t size,
+ const efpak_index_ext_t* index, size_t raw_size,
+ efpak_pool_t* pool
+)
+{
+  efpak_pinflate_t* const pinfl = &mem->pinflate;
+  efpak_pinflate_slot_t* slot;
+  size_t span_size;
+  size_t i;
+
+  /* find the largest span */
+
+  pinfl->max_span_size = 0;
+  for (i = 0; i != (size_t)index->count; ++i)
+  {
+    if ((i + 1) == (size_t)index->count) span_size = raw_size;
+    else span_size = (size_t)index->entries[i + 1].raw_off;
+    span_size -= (size_t)index->entries[i].raw_off;
+    if (span_size > pinfl->max_span_size) pinfl->max_span_size = span_size;
+  }
+
+  if (pinfl->max_span_size > pinflate_max_span_size) goto on_error_0;
+
+  pinfl->comp = comp;
+  pinfl->slot_count = pool->thread_count + 1;
+  pinfl->slots = malloc(pinfl->slot_count * sizeof(efpak_pinflate_slot_t));
+  if (pinfl->slots == NULL) goto on_error_0;
+
+  for (i = 0; i != pinfl->slot_count; ++i)
+  {
+    slot = &pinfl->slots[i];
+
+    if (pinflate_slot_init(pinfl, slot)) goto on_error_1;
+
+    slot->obuf = malloc(pinfl->max_span_size);
+    if (slot->obuf == NULL)
+    {
+      pinflate_slot_fini(pinfl, slot);
+      goto on_error_1;
+    }
+  }
+
+  mem_init(mem, data, size);
+  mem->index = index;
+  mem->seek = pinflate_mem_seek;
+  mem->next = pinflate_mem_next;
+  mem->fini = pinflate_mem_fini;
+  mem->get_ipos = pinflate_mem_get_ipos;
+  mem->next_batch = pinflate_mem_next_batch;
+
+  pinfl->pool = pool;
+  pinfl->raw_size = raw_size;
+  pinfl->batch_entry = 0;
+  pinfl->batch_count = 0;
+  pinfl->slot_pos = 0;
+  pinfl->slot_off = 0;
+  pinfl->crc = crc32(0, Z_NULL, 0);
+  pinfl->crc_entry = 0;
+
+  return 0;
+
+ on_error_1:
+  pinflate_mem_free(pinfl, i);
+ on_error_0:
+  return -1;
+}
+
+
+/* file mapping */
+
+static int map_fd(int fd, const uint8_t** addr, size_t* size)
+{
+  struct stat64 st;
+
+  if (fstat64(fd, &st)) return -1;
+
+  /* larger than the address space */
+  if ((uint64_t)st.st_size > (uint64_t)(size_t)-1) return -1;
+
+  *size = (size_t)st.st_size;
+  *addr = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+  if (*addr == (const uint8_t*)MAP_FAILED) return -1;
+
+  return 0;
+}
+
+static int map_file(const char* path, const uint8_t** addr, size_t* size)
+{
+  int fd;
+  int err;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+
+  err = map_fd(fd, addr, size);
+  close(fd);
+
+  return err;
+}
+
+static void unmap_file(const uint8_t* addr, size_t size)
+{
+  munmap((void*)addr, size);
+}
+
+
+/* table of contents */
+
+static void load_toc(efpak_istream_t* is)
+{
+  /* use the table of contents if the package ends with one */
+
+  static const size_t trailer_size = sizeof(efpak_toc_trailer_t);
+  const efpak_toc_trailer_t* t;
+  const efpak_header_t* h;
+  size_t size;
+
+  is->toc = NULL;
+  is->toc_count = 0;
+
+  if (is->size < trailer_size) return ;
+  t = (const efpak_toc_trailer_t*)(is->data + is->size - trailer_size);
+  if (t->magic != EFPAK_TOC_MAGIC) return ;
+
+  size = is->size - trailer_size;
+  if (t->off > (uint64_t)size) return ;
+  if ((size - (size_t)t->off) < header_min_size) return ;
+
+  h = (const efpak_header_t*)(is->data + t->off);
+  if (h->type != EFPAK_BTYPE_TOC) return ;
+  if (h->comp != EFPAK_BCOMP_NONE) return ;
+  if (h->header_size < (header_min_size + sizeof(efpak_toc_header_t))) return ;
+
+  size = (size_t)h->u.toc.count * sizeof(efpak_toc_entry_t) + trailer_size;
+  if (h->comp_data_size != (uint64_t)size) return ;
+  if (h->header_size > (is->size - (size_t)t->off - size)) return ;
+  if (((size_t)t->off + get_block_size(h)) != is->size) return ;
+
+  is->toc = (const efpak_toc_entry_t*)(is->data + t->off + h->header_size);
+  is->toc_count = (size_t)h->u.toc.count;
+}
+
+static const efpak_header_t* get_toc_header
+(const efpak_istream_t* is, size_t i)
+{
+  /* return the header of the i-th toc entry, or NULL if invalid */
+
+  const efpak_toc_entry_t* const e = &is->toc[i];
+  const efpak_header_t* h;
+
+  if (e->off > (uint64_t)is->size) return NULL;
+  if ((is->size - (size_t)e->off) < header_min_size) return NULL;
+
+  h = (const efpak_header_t*)(is->data + e->off);
+  if (h->type != e->type) return NULL;
+  if (get_block_size(h) != e->size) return NULL;
+  if (e->size > (uint64_t)(is->size - (size_t)e->off)) return NULL;
+
+  return h;
+}
+
+
+/* input stream exported routines */
+
+int efpak_istream_init_with_mem
+(efpak_istream_t* is, const uint8_t* data, size_t size)
+{
+  is->data = data;
+  is->off = 0;
+  is->size = size;
+  is->header = NULL;
+  is->is_in_block = 0;
+  is->pool = NULL;
+  is->thread_count = 1;
+  is->max_dict_size = 0;
+  is->point_span = 0;
+  is->point_mem_size = 0;
+  is->mem.has_inflate = 0;
+  is->mem.oneshot_dctx = NULL;
+  is->oneshot_size = 0;
+  is->sparse = NULL;
+  is->package = NULL;
+  is->fd = -1;
+  is->hbuf = NULL;
+  is->hbuf_size = 0;
+  is->ibuf = NULL;
+  is->irem = 0;
+  is->foff = 0;
+  is->win_size = 0;
+  is->is_fd_owned = 0;
+  is->map_fd = -1;
+  is->ra_size = 0;
+  is->ra_off = 0;
+  is->drop_off = 0;
+  load_toc(is);
+  return 0;
+}
+
+/* initial header buffer size, grown for larger headers */
+static const size_t fd_header_size = 4096;
+
+/* largest header read from a stream, bounding the allocation */
+static const size_t fd_max_header_size = 64 * 1024 * 1024;
+
+int efpak_istream_init_with_fd
+(efpak_istream_t* is, int fd)
+{
+  /* sequential input from a pipe or socket, which is not mapped. */
+  /* only the current header and a window of its data are held, */
+  /* and blocks cannot be sought nor the table of contents used. */
+
+  if (efpak_istream_init_with_mem(is, NULL, 0)) goto on_error_0;
+
+  is->hbuf = malloc(fd_header_size);
+  if (is->hbuf == NULL) goto on_error_0;
+  is->hbuf_size = fd_header_size;
+
+  is->ibuf = malloc(fd_window_size);
+  if (is->ibuf == NULL) goto on_error_1;
+
+  is->fd = fd;
+
+  return 0;
+
+ on_error_1:
+  free(is->hbuf);
+ on_error_0:
+  return -1;
+}
+
+int efpak_istream_init_with_fd_window
+(efpak_istream_t* is, int fd, size_t size)
+{
+  /* sequential input from a seekable file, mapped by windows of */
+  /* size bytes, so that the package size is not limited by the */
+  /* address space. headers are read, and block data mapped. */
+
+  const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+  if (size < (2 * page_size)) return -1;
+
+  if (efpak_istream_init_with_mem(is, NULL, 0)) goto on_error_0;
+
+  is->hbuf = malloc(fd_header_size);
+  if (is->hbuf == NULL) goto on_error_0;
+  is->hbuf_size = fd_header_size;
+
+  is->fd = fd;
+  is->win_size = size;
+
+  return 0;
+
+ on_error_0:
+  return -1;
+}
+
+/* mapped window size, used when the package cannot be mapped whole */
+static const size_t fd_map_window_size = 64 * 1024 * 1024;
+
+int efpak_istream_init_with_file
+(efpak_istream_t* is, const char* s)
+{
+  /* the file is kept open for page cache hints. if the package is */
+  /* larger than the address space, it is mapped by windows. */
+
+  const uint8_t* data;
+  size_t size;
+  int fd;
+
+  fd = open(s, O_RDONLY | O_LARGEFILE);
+  if (fd == -1) goto on_error_0;
+
+  if (map_fd(fd, &data, &size))
+  {
+    if (efpak_istream_init_with_fd_window(is, fd, fd_map_window_size))
+      goto on_error_1;
+    is->is_fd_owned = 1;
+    return 0;
+  }
+
+  if (efpak_istream_init_with_mem(is, data, size)) goto on_error_2;
+  is->map_fd = fd;
+  return 0;
+
+ on_error_2:
+  unmap_file(data, size);
+ on_error_1:
+  close(fd);
+ on_error_0:
+  return -1;
+}
+
+void efpak_istream_fini
+(efpak_istream_t* is)
+{
+  if (is->is_in_block == 1) efpak_istream_end_block(is);
+  if (is->mem.has_inflate) inflate_fini(&is->mem.inflate);
+#ifdef CONFIG_LIBDEFLATE
+  if (is->mem.oneshot_dctx != NULL)
+    libdeflate_free_decompressor(is->mem.oneshot_dctx);
+#endif /* CONFIG_LIBDEFLATE */
+  pool_destroy(is->pool);
+  free(is->hbuf);
+  free(is->ibuf);
+  if ((is->package == NULL) && (is->fd == -1))
+    unmap_file(is->data, is->size);
+  if (is->map_fd != -1) close(is->map_fd);
+  if (is->is_fd_owned) close(is->fd);
+}
+
+int efpak_istream_set_thread_count
+(efpak_istream_t* is, size_t n)
+{
+  /* n the count of threads used to decompress, including caller */
+  /* ASSUME: is->is_in_block == 0 */
+
+  efpak_pool_t* pool = NULL;
+
+  if (n == 0) return -1;
+
+  if (n > 1)
+  {
+    pool = pool_create(n);
+    if (pool == NULL) return -1;
+  }
+
+  pool_destroy(is->pool);
+  is->pool = pool;
+  is->thread_count = n;
+
+  return 0;
+}
+
+void efpak_istream_set_max_dict_size
+(efpak_istream_t* is, size_t size)
+{
+  is->max_dict_size = size;
+}
+
+void efpak_istream_set_readahead
+(efpak_istream_t* is, size_t size)
+{
+  /* size the window read ahead of the consumed package data, and */
+  /* dropped from the page cache behind it. 0 gives no hint. only */
+  /* the packages mapped by the istream are advised. */
+
+  is->ra_size = size;
+  is->ra_off = 0;
+  is->drop_off = 0;
+
+  if ((is->map_fd == -1) || (size == 0)) return ;
+
+  madvise((void*)is->data, is->size, MADV_SEQUENTIAL);
+}
+
+void efpak_istream_set_oneshot_size
+(efpak_istream_t* is, size_t size)
+{
+  /* zlib blocks whose raw data size is up to size bytes are decoded */
+  /* whole in memory, faster than by output blocks with libdeflate. */
+  /* 0 decodes all the blocks by output blocks. */
+
+  is->oneshot_size = size;
+}
+
+void efpak_istream_set_checkpoints
+(efpak_istream_t* is, size_t span, size_t size)
+{
+  /* record zlib access points about every span bytes of the blocks */
+  /* without index, using up to size bytes, so that they can be */
+  /* sought backward. 0 records none, backward seeks restarting */
+  /* from the block start. */
+
+  is->point_span = span;
+  is->point_mem_size = size;
+}
+
+static void advise_data(efpak_istream_t* is)
+{
+  /* advise the pages around the data consumed by the current block */
+  /* decoder. the next window is advised once half of the current */
+  /* one is read, and the consumed data dropped by windows too. */
+
+  size_t page_mask;
+  size_t off;
+  size_t lo;
+  size_t hi;
+
+  if ((is->ra_size == 0) || (is->map_fd == -1)) return ;
+
+  page_mask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+
+  off = is->off + (size_t)is->header->header_size;
+  off += is->mem.get_ipos(&is->mem);
+  if (off > is->size) off = is->size;
+
+  /* data ahead. a forward seek skips the window */
+  if (is->ra_off < off) is->ra_off = off;
+  if ((is->ra_off < is->size) && ((is->ra_off - off) < (is->ra_size / 2)))
+  {
+    lo = is->ra_off & ~page_mask;
+    hi = off + is->ra_size;
+    if (hi > is->size) hi = is->size;
+    if (lo < hi) madvise((void*)(is->data + lo), hi - lo, MADV_WILLNEED);
+    is->ra_off = hi;
+  }
+
+  /* data behind, reread if the stream goes backward */
+  if (off < is->drop_off) is->drop_off = off & ~page_mask;
+  if ((off - is->drop_off) >= is->ra_size)
+  {
+    lo = is->drop_off;
+    hi = off & ~page_mask;
+    madvise((void*)(is->data + lo), hi - lo, MADV_DONTNEED);
+    posix_fadvise(is->map_fd, (off_t)lo, (off_t)(hi - lo), POSIX_FADV_DONTNEED);
+    is->drop_off = hi;
+  }
+}
+
+static size_t read_fd(efpak_istream_t* is, uint8_t* buf, size_t size)
+{
+  /* read from the current file offset */
+
+  size_t n;
+
+  if (is->win_size) n = pread_full(is->fd, buf, size, is->foff);
+  else n = read_full(is->fd, buf, size);
+
+  if (n != (size_t)-1) is->foff += (uint64_t)n;
+
+  return n;
+}
+
+static int next_fd_block(efpak_istream_t* is)
+{
+  /* skip the current block data not yet read, and read the next */
+  /* header. the header is NULL at the end of the stream. */
+
+  size_t size;
+  size_t n;
+  uint8_t* p;
+
+  if (is->win_size)
+  {
+    is->foff += (uint64_t)is->irem;
+    is->irem = 0;
+  }
+
+  while (is->irem)
+  {
+    n = fd_window_size;
+    if ((uint64_t)n > is->irem) n = (size_t)is->irem;
+    if (read_fd(is, is->ibuf, n) != n) return -1;
+    is->irem -= n;
+  }
+
+  if (is->header != NULL)
+  {
+    is->off += (size_t)get_block_size(is->header);
+    is->header = NULL;
+  }
+
+  n = read_fd(is, is->hbuf, header_min_size);
+  if (n == 0) return 0;
+  if (n != header_min_size) return -1;
+
+  size = (size_t)((const efpak_header_t*)is->hbuf)->header_size;
+  if ((size < header_min_size) || (size > fd_max_header_size)) return -1;
+
+  if (size > is->hbuf_size)
+  {
+    p = realloc(is->hbuf, size);
+    if (p == NULL) return -1;
+    is->hbuf = p;
+    is->hbuf_size = size;
+  }
+
+  n = size - header_min_size;
+  if (read_fd(is, is->hbuf + header_min_size, n) != n) return -1;
+
+  is->header = (const efpak_header_t*)is->hbuf;
+  is->irem = is->header->comp_data_size;
+
+  return 0;
+}
+
+static int seek_fd_block(efpak_istream_t* is, uint64_t foff, size_t off)
+{
+  /* read the header at the file offset foff, off in the package */
+  /* ASSUME: is->win_size != 0 */
+
+  is->header = NULL;
+  is->irem = 0;
+  is->foff = foff;
+  is->off = off;
+
+  return next_fd_block(is);
+}
+
+static uint64_t get_fd_data_off(const efpak_istream_t* is)
+{
+  /* file offset of the current block data, even partly read */
+  return is->foff - (is->header->comp_data_size - is->irem);
+}
+
+static int find_fd_file
+(efpak_istream_t* is, const char* path, size_t len, size_t* i)
+{
+  /* walk the headers of a windowed input, and restore the current */
+  /* one, whose data may have been partly read */
+
+  const efpak_header_t* const h = is->header;
+  const uint64_t foff = is->foff;
+  const uint64_t irem = is->irem;
+  const size_t off = is->off;
+  uint64_t hoff = 0;
+  size_t n;
+
+  if (is->win_size == 0) return -1;
+
+  if (h != NULL) hoff = get_fd_data_off(is) - h->header_size;
+
+  if (seek_fd_block(is, 0, 0)) return -1;
+
+  for (n = 0; is->header != NULL; ++n)
+  {
+    if ((is->header->type == EFPAK_BTYPE_FILE) &&
+	(is->header->u.file.path_len == (len + 1)) &&
+	(memcmp(is->header->u.file.path, path, len + 1) == 0))
+    {
+      *i = n;
+      break ;
+    }
+
+    if (next_fd_block(is)) return -1;
+  }
+
+  if (h == NULL)
+  {
+    is->header = NULL;
+    is->irem = irem;
+    is->foff = foff;
+    is->off = off;
+    return 0;
+  }
+
+  if (seek_fd_block(is, hoff, off)) return -1;
+  is->irem = irem;
+  is->foff = foff;
+
+  return 0;
+}
+
+int efpak_istream_next_block
+(efpak_istream_t* is, const efpak_header_t** h)
+{
+  /* TODO: convert header fields if local endianness is not little */
+  /* TODO: to do so, first internally allocate a header, convert */
+  /* TODO: the fields and return this allocated header. take care */
+  /* TODO: of releasing when no longer needed. */
+
+#if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "unsupported endianness"
+#endif
+
+  if (is->fd != -1)
+  {
+    if (next_fd_block(is)) return -1;
+    goto on_success;
+  }
+
+  if (is->header != NULL)
+  {
+    const size_t off =
+      is->off + is->header->header_size + is->header->comp_data_size;
+    if (off > is->size) return -1;
+    is->off = off;
+  }
+
+  if (is->off == is->size)
+  {
+    is->header = NULL;
+    goto on_success;
+  }
+
+  is->header = (const efpak_header_t*)(is->data + is->off);
+  if ((is->off + is->header->header_size) > is->size) return -1;
+
+ on_success:
+  *h = is->header;
+  return 0;
+}
+
+int efpak_istream_seek_block
+(efpak_istream_t* is, size_t i, const efpak_header_t** h)
+{
+  /* position on the i-th block, and return its header, or NULL if */
+  /* none. next_block then returns the following block. uses the */
+  /* table of contents if any, or walks the previous headers. */
+  /* ASSUME: is->is_in_block == 0 */
+
+  size_t n;
+
+  if (is->fd != -1)
+  {
+    /* windows rewind to the first header, pipes cannot go back */
+    if (is->win_size == 0) return -1;
+
+    if (seek_fd_block(is, 0, 0)) return -1;
+    for (n = 0; (n != i) && (is->header != NULL); ++n)
+    {
+      if (next_fd_block(is)) return -1;
+    }
+
+    *h = is->header;
+    return 0;
+  }
+
+  if (is->package != NULL)
+  {
+    *h = efpak_package_get_block(is->package, i);
+    if (*h == NULL) goto on_none;
+
+    is->header = *h;
+    is->off = (size_t)((const uint8_t*)*h - is->data);
+
+    return 0;
+  }
+
+  if (is->toc != NULL)
+  {
+    if (i >= is->toc_count) goto on_none;
+
+    *h = get_toc_header(is, i);
+    if (*h == NULL) return -1;
+
+    is->header = *h;
+    is->off = (size_t)is->toc[i].off;
+
+    return 0;
+  }
+
+  is->off = 0;
+  is->header = NULL;
+
+  for (n = 0; n <= i; ++n)
+  {
+    if (efpak_istream_next_block(is, h)) return -1;
+    if (*h == NULL) break ;
+  }
+
+  return 0;
+
+ on_none:
+  is->off = is->size;
+  is->header = NULL;
+  *h = NULL;
+  return 0;
+}
+
+int efpak_istream_find_file
+(efpak_istream_t* is, const char* path, size_t* i)
+{
+  /* find the file block whose destination is path, and set i to */
+  /* its index, or to -1 if none. the stream is not moved. */
+
+  const size_t len = strlen(path);
+  const uint32_t hash = get_path_hash((const uint8_t*)path, len);
+  const efpak_header_t* h;
+  size_t off;
+  size_t n;
+
+  *i = (size_t)-1;
+
+  /* streamed input is not held in memory, headers are read */
+  if (is->fd != -1) return find_fd_file(is, path, len, i);
+
+  for (n = 0, off = 0; 1; ++n)
+  {
+    if (is->toc != NULL)
+    {
+      if (n == is->toc_count) break ;
+      if (is->toc[n].type != EFPAK_BTYPE_FILE) continue ;
+      if (is->toc[n].path_hash != hash) continue ;
+      h = get_toc_header(is, n);
+      if (h == NULL) return -1;
+    }
+    else
+    {
+      if (off == is->size) break ;
+      if ((is->size - off) < header_min_size) return -1;
+      h = (const efpak_header_t*)(is->data + off);
+      if (get_block_size(h) > (is->size - off)) return -1;
+      off += get_block_size(h);
+      if (h->type != EFPAK_BTYPE_FILE) continue ;
+    }
+
+    if (h->u.file.path_len != (len + 1)) continue ;
+    if (memcmp(h->u.file.path, path, len + 1)) continue ;
+
+    *i = n;
+    break ;
+  }
+
+  return 0;
+}
+
+int efpak_istream_start_block
+(efpak_istream_t* is)
 {
   /* prepare block related context */
 
   const efpak_header_t* const h = is->header;
-  const uint8_t* data;
-  size_t size;
+  const uint8_t* data;
+  size_t size;
+  size_t ipos;
+  int err = -1;
+
+  /* ASSUME: is->is_in_block == 0 */
+
+  /* TODO: check sum overflow */
+
+  if (is->fd != -1)
+  {
+    /* streamed block data can be read only once */
+    if (is->irem != h->comp_data_size) goto on_error;
+  }
+  else if ((is->off + h->header_size + h->comp_data_size) > is->size)
+  {
+    goto on_error;
+  }
+
+  /* refuse blocks whose decoder would need too much memory */
+  if (is->max_dict_size)
+  {
+    const efpak_dict_ext_t* const dict = get_dict_ext(h);
+    if ((dict != NULL) && ((size_t)dict->dict_size > is->max_dict_size))
+    {
+      PERROR();
+      goto on_error;
+    }
+  }
+
+  /* holes are not stored, a corrupted extent map is fatal */
+  is->sparse = get_sparse_ext(h);
+  if ((is->sparse == NULL) && efpak_header_find_ext(h, EFPAK_EXT_SPARSE))
+  {
+    PERROR();
+    goto on_error;
+  }
+
+  is->sparse_off = 0;
+  is->sparse_extent = 0;
+
+  is->mem.fd = -1;
+  is->mem.irem = 0;
+  is->mem.win_size = 0;
+  is->mem.map_addr = NULL;
+  is->mem.point_span = is->point_span;
+  is->mem.point_mem_size = is->point_mem_size;
+
+  if (is->fd != -1)
+  {
+    /* read the first window of the block data */
+    is->mem.fd = is->fd;
+    is->mem.ibuf = is->ibuf;
+    is->mem.irem = is->irem;
+    is->mem.foff = is->foff;
+    is->mem.win_size = is->win_size;
+    is->mem.data = is->ibuf;
+    is->mem.size = 0;
+    ipos = 0;
+    if (mem_refill(&is->mem, &ipos)) goto on_error;
+    is->irem = is->mem.irem;
+    is->foff = is->mem.foff;
+    data = is->mem.data;
+    size = is->mem.size;
+  }
+  else
+  {
+    data = is->data + is->off + h->header_size;
+    size = h->comp_data_size;
+  }
+
+  switch ((efpak_bcomp_t)is->header->comp)
+  {
+  case EFPAK_BCOMP_NONE:
+    {
+      if (is->fd != -1) err = window_mem_init(&is->mem, data, size);
+      else err = ram_mem_init(&is->mem, data, size);
+      break ;
+    }
+
+  default:
+    {
+      /* streamed data cannot be restarted nor decoded in parallel */
+      const efpak_bcomp_t comp = (efpak_bcomp_t)h->comp;
+      const efpak_index_ext_t* const index =
+	(is->fd == -1) ? get_index_ext(h) : NULL;
+      const size_t raw_size = (size_t)h->raw_data_size;
+
+      /* decode index spans in parallel if possible */
+      err = -1;
+      if ((index != NULL) && (is->pool != NULL))
+      {
+	err = pinflate_mem_init
+	  (&is->mem, comp, data, size, index, raw_size, is->pool);
+      }
+
+      /* or decode the whole block if small enough */
+      if (err && (comp == EFPAK_BCOMP_ZLIB) && (is->fd == -1))
+      {
+	if ((raw_size != 0) && (raw_size <= is->oneshot_size))
+	  err = oneshot_mem_init(&is->mem, data, size, raw_size);
+      }
+
+      if (err) err = codec_mem_init(&is->mem, comp, data, size, index);
+
+      break ;
+    }
+  }
+
+  if (err == 0) is->is_in_block = 1;
+  else mem_unmap(&is->mem);
+
+ on_error:
+  return err;
+}
+
+void efpak_istream_end_block
+(efpak_istream_t* is)
+{
+  /* ASSUME: is->is_in_block == 1 */
+
+  if (is->fd != -1)
+  {
+    is->irem = is->mem.irem;
+    is->foff = is->mem.foff;
+  }
+
+  advise_data(is);
+  mem_ring_fini(&is->mem);
+  is->mem.fini(&is->mem);
+  mem_unmap(&is->mem);
+  is->is_in_block = 0;
+}
+
+/* sparse blocks. the istream offsets are in the block contents. */
+/* data extents are read from the block memory, which is positioned */
+/* lazily, and zero runs from a zeroed buffer. */
+
+static uint8_t sparse_zero_buf[64 * 1024];
+
+static size_t find_extent(const efpak_sparse_ext_t* sparse, size_t off)
+{
+  /* return the first extent ending after off, or count if none */
+
+  const efpak_extent_t* e;
+  size_t lo = 0;
+  size_t hi = sparse->count;
+  size_t mid;
+
+  while (lo != hi)
+  {
+    mid = lo + (hi - lo) / 2;
+    e = &sparse->extents[mid];
+    if ((e->off + e->size) <= (uint64_t)off) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+static const efpak_extent_t* get_data_extent(efpak_istream_t* is)
+{
+  /* return the extent containing the current offset, NULL if in */
+  /* a zero run */
+
+  const efpak_sparse_ext_t* const sparse = is->sparse;
+  const efpak_extent_t* e;
+
+  if (is->sparse_extent == sparse->count) return NULL;
+  e = &sparse->extents[is->sparse_extent];
+  if (e->off > (uint64_t)is->sparse_off) return NULL;
+  return e;
+}
+
+static size_t get_zero_size(efpak_istream_t* is)
+{
+  /* ASSUME(get_data_extent(is) == NULL) */
+
+  const efpak_sparse_ext_t* const sparse = is->sparse;
+  uint64_t end = sparse->size;
+
+  if (is->sparse_extent != sparse->count)
+    end = sparse->extents[is->sparse_extent].off;
+
+  return (size_t)end - is->sparse_off;
+}
+
+static void sparse_advance(efpak_istream_t* is, size_t n)
+{
+  const efpak_extent_t* const e = get_data_extent(is);
+
+  is->sparse_off += n;
+
+  if ((e != NULL) && ((e->off + e->size) == (uint64_t)is->sparse_off))
+    ++is->sparse_extent;
+}
+
+static int sparse_seek(efpak_istream_t* is, size_t off)
+{
+  const efpak_sparse_ext_t* const sparse = is->sparse;
+  const efpak_extent_t* e;
+  size_t data_off;
+  size_t k;
+
+  if ((uint64_t)off > sparse->size) return -1;
+
+  /* position the block memory now to report errors early */
+  k = find_extent(sparse, off);
+  if (k != sparse->count)
+  {
+    e = &sparse->extents[k];
+    data_off = (size_t)e->data_off;
+    if (e->off < (uint64_t)off) data_off += off - (size_t)e->off;
+    if (is->mem.seek(&is->mem, data_off)) return -1;
+  }
+
+  is->sparse_off = off;
+  is->sparse_extent = k;
+
+  return 0;
+}
+
+static int sparse_next
+(efpak_istream_t* is, const uint8_t** data, size_t* size)
+{
+  const efpak_extent_t* const e = get_data_extent(is);
+  size_t data_off;
+  size_t n;
+
+  if (e != NULL)
+  {
+    n = (size_t)(e->off + e->size) - is->sparse_off;
+    if (*size < n) n = *size;
+
+    data_off = (size_t)e->data_off + (is->sparse_off - (size_t)e->off);
+    if (is->mem.off != data_off)
+    {
+      if (is->mem.seek(&is->mem, data_off)) return -1;
+    }
+
+    if (is->mem.next(&is->mem, data, &n)) return -1;
+
+    /* the raw data is shorter than its extents */
+    if (n == 0) return -1;
+  }
+  else
+  {
+    n = get_zero_size(is);
+    if (n > sizeof(sparse_zero_buf)) n = sizeof(sparse_zero_buf);
+    if (*size < n) n = *size;
+    *data = sparse_zero_buf;
+  }
+
+  sparse_advance(is, n);
+  *size = n;
+
+  return 0;
+}
+
+int efpak_istream_seek
+(efpak_istream_t* is, size_t off)
+{
+  /* ASSUME: is->is_in_block == 1 */
+
+  if (is->sparse != NULL) return sparse_seek(is, off);
+  return is->mem.seek(&is->mem, off);
+}
+
+int efpak_istream_next
+(efpak_istream_t* is, const uint8_t** data, size_t* size)
+{
+  /* ASSUME: is->is_in_block == 1 */
+
+  int err;
+
+  if (is->sparse != NULL) err = sparse_next(is, data, size);
+  else err = is->mem.next(&is->mem, data, size);
+
+  advise_data(is);
+
+  return err;
+}
+
+int efpak_istream_next_batch
+(efpak_istream_t* is, struct iovec* iov, size_t* count, size_t* size)
+{
+  /* fill up to count ranges with up to size bytes of block data, */
+  /* any if size is (size_t)-1. the ranges are valid until the next */
+  /* call. count and size are set to the filled ones, 0 at the end. */
+
+  /* ASSUME: is->is_in_block == 1 */
+  /* ASSUME: *count != 0 */
+
+  const uint8_t* data;
+  int err;
+
+  if (is->sparse != NULL)
+  {
+    /* zero runs and data extents are returned one by one */
+    err = sparse_next(is, &data, size);
+    *count = 0;
+    if ((err == 0) && *size)
+    {
+      iov[0].iov_base = (void*)data;
+      iov[0].iov_len = *size;
+      *count = 1;
+    }
+  }
+  else
+  {
+    err = is->mem.next_batch(&is->mem, iov, count, size);
+  }
+
+  advise_data(is);
+
+  return err;
+}
+
+int efpak_istream_next_zero
+(efpak_istream_t* is, size_t* size)
+{
+  /* skip up to size bytes of the zero run at the current offset. */
+  /* size is set to the skipped size, 0 if not in a zero run. */
+
+  /* ASSUME: is->is_in_block == 1 */
+
+  size_t n = 0;
+
+  if ((is->sparse != NULL) && (get_data_extent(is) == NULL))
+  {
+    n = get_zero_size(is);
+    if (*size < n) n = *size;
+    sparse_advance(is, n);
+  }
+
+  *size = n;
+
+  return 0;
+}
+
+
+/* kernel copies of uncompressed block data, without user copies */
+
+static unsigned int is_copy_unsupported(int err)
+{
+  return (err == EINVAL) || (err == ENOSYS) || (err == EXDEV) ||
+    (err == EOPNOTSUPP) || (err == ESPIPE) || (err == EBADF);
+}
+
+static size_t copy_fd(int ifd, uint64_t* ioff, int ofd, size_t size)
+{
+  /* copy size bytes from ifd at ioff, or from its position if ioff */
+  /* is NULL as for pipes. return 0 if the kernel cannot copy them, */
+  /* so that they are read instead, and (size_t)-1 on error. */
+
+  static const size_t max_size = 1024 * 1024 * 1024;
+  size_t i;
+  ssize_t n;
+  loff_t off;
+  off64_t off64;
+
+  for (i = 0; i != size; i += (size_t)n)
+  {
+    const size_t k = ((size - i) > max_size) ? max_size : (size - i);
+
+    if (ioff == NULL)
+    {
+      n = splice(ifd, NULL, ofd, NULL, k, SPLICE_F_MOVE);
+    }
+    else
+    {
+      off = (loff_t)*ioff;
+      n = copy_file_range(ifd, &off, ofd, NULL, k, 0);
+      if ((n < 0) && is_copy_unsupported(errno))
+      {
+	off64 = (off64_t)*ioff;
+	n = sendfile64(ofd, ifd, &off64, k);
+      }
+      if (n > 0) *ioff += (uint64_t)n;
+    }
+
+    if (n <= 0)
+    {
+      if ((n < 0) && (errno == EINTR))
+      {
+	n = 0;
+	continue ;
+      }
+
+      if ((n < 0) && (i == 0) && is_copy_unsupported(errno)) return 0;
+
+      PERROR();
+      return (size_t)-1;
+    }
+  }
+
+  return i;
+}
+
+int efpak_istream_next_copy
+(efpak_istream_t* is, int fd, size_t* size)
+{
+  /* copy up to size bytes of uncompressed block data to fd at its */
+  /* position, by the kernel. size is set to the copied size, 0 if */
+  /* the data cannot be copied and must be read with next. */
+
+  /* ASSUME: is->is_in_block == 1 */
+
+  efpak_imem_t* const mem = &is->mem;
+  efpak_decoder_t* const w = &mem->decoder;
+  size_t avail;
+  size_t win;
+  size_t n = 0;
+  uint64_t off;
+
+  if (is->header->comp != EFPAK_BCOMP_NONE) goto on_done;
+  if (is->sparse != NULL) goto on_done;
+
+  if (mem->fd == -1)
+  {
+    /* whole block data mapped from the package file */
+    if (is->map_fd == -1) goto on_done;
+
+    avail = mem->size - mem->off;
+    n = (*size < avail) ? *size : avail;
+    if (n == 0) goto on_done;
+
+    off = (uint64_t)(is->off + (size_t)is->header->header_size + mem->off);
+    n = copy_fd(is->map_fd, &off, fd, n);
+    if (n == (size_t)-1) return -1;
+
+    mem->off += n;
+
+    goto on_done;
+  }
+
+  /* streamed block data. the current output block is read first */
+  if (mem->oblock_size) goto on_done;
+
+  win = mem->size - w->ipos;
+  avail = (size_t)-1;
+  if (mem->irem < (uint64_t)(avail - win)) avail = win + (size_t)mem->irem;
+  n = (*size < avail) ? *size : avail;
+  if (n == 0) goto on_done;
+
+  if (mem->win_size)
+  {
+    off = mem->foff - (uint64_t)win;
+    n = copy_fd(mem->fd, &off, fd, n);
+  }
+  else if (win == 0)
+  {
+    /* pipes are copied from their position, after the window */
+    n = copy_fd(mem->fd, NULL, fd, n);
+  }
+  else
+  {
+    n = 0;
+  }
+
+  if (n == (size_t)-1) return -1;
+
+  if (n <= win)
+  {
+    w->ipos += n;
+  }
+  else
+  {
+    w->ipos = mem->size;
+    mem->irem -= n - win;
+    mem->foff += (uint64_t)(n - win);
+  }
+
+  mem->off += n;
+
+ on_done:
+  *size = n;
+  return 0;
+}
+
+
+/* shared package. the package data and block headers are read */
+/* only once opened, and istreams initialized with the package are */
+/* cursors owning their decoder, which can be used concurrently. */
+
+static int index_blocks(efpak_package_t* pkg)
+{
+  /* index the block headers, from the table of contents if any */
+
+  efpak_istream_t is;
+  const efpak_toc_entry_t* e;
+  const efpak_header_t* h;
+  size_t max_count;
+  size_t i;
+
+  efpak_istream_init_with_mem(&is, pkg->data, pkg->size);
+
+  max_count = (is.toc != NULL) ? (is.toc_count + 1) : 256;
+  pkg->headers = malloc(max_count * sizeof(efpak_header_t*));
+  if (pkg->headers == NULL) return -1;
+  pkg->block_count = 0;
+
+  if (is.toc != NULL)
+  {
+    for (i = 0; i != is.toc_count; ++i)
+    {
+      pkg->headers[i] = get_toc_header(&is, i);
+      if (pkg->headers[i] == NULL) goto on_error;
+    }
+
+    /* the toc block follows the listed ones */
+    h = (const efpak_header_t*)is.data;
+    if (is.toc_count)
+    {
+      e = &is.toc[is.toc_count - 1];
+      h = (const efpak_header_t*)(is.data + e->off + e->size);
+    }
+
+    pkg->headers[i] = h;
+    pkg->block_count = i + 1;
+
+    return 0;
+  }
+
+  while (1)
+  {
+    if (efpak_istream_next_block(&is, &h)) goto on_error;
+    if (h == NULL) break ;
+
+    if (pkg->block_count == max_count)
+    {
+      const efpak_header_t** const x = realloc
+	(pkg->headers, 2 * max_count * sizeof(efpak_header_t*));
+      if (x == NULL) goto on_error;
+      pkg->headers = x;
+      max_count *= 2;
+    }
+
+    pkg->headers[pkg->block_count++] = h;
+  }
+
+  return 0;
+
+ on_error:
+  free(pkg->headers);
+  return -1;
+}
+
+int efpak_istream_init_with_package
+(efpak_istream_t* is, efpak_package_t* pkg)
+{
+  if (efpak_istream_init_with_mem(is, pkg->data, pkg->size)) return -1;
+  is->package = pkg;
+  return 0;
+}
+
+
+/* random access file reads. block contents are decoded by chunks */
+/* kept in a package wide cache, the least recently used one being */
+/* evicted. a missed chunk is decoded with the file own cursor, which */
+/* restarts the block only when going backward without index. */
+
+static const size_t chunk_size = 64 * 1024;
+static const size_t chunk_count = 16;
+
+/* zlib access points of file cursors */
+static const size_t file_point_span = 1024 * 1024;
+static const size_t file_point_size = 4 * 1024 * 1024;
+
+static int start_block_at(efpak_istream_t* is, const efpak_header_t* h)
+{
+  /* h a block header previously found in is, or the current one */
+
+  if (h != is->header)
+  {
+    is->header = h;
+    is->off = (size_t)((const uint8_t*)h - is->data);
+  }
+
+  return efpak_istream_start_block(is);
+}
+
+static int decode_chunk(efpak_file_t* file, size_t index, size_t* size)
+{
+  /* decode the index chunk in file->buf */
+
+  efpak_istream_t* const is = &file->is;
+  const size_t off = index * chunk_size;
+  const uint8_t* p;
+  size_t n;
+
+  if ((is->is_in_block == 0) && start_block_at(is, file->header))
+    return -1;
+
+  if (efpak_istream_seek(is, off))
+  {
+    /* going backward, restart the block */
+    efpak_istream_end_block(is);
+    if (start_block_at(is, file->header)) return -1;
+    if (efpak_istream_seek(is, off)) return -1;
+  }
+
+  for (*size = 0; *size != chunk_size; *size += n)
+  {
+    n = chunk_size - *size;
+    if (efpak_istream_next(is, &p, &n)) return -1;
+    if (n == 0) break ;
+    memcpy(file->buf + *size, p, n);
+  }
+
+  return 0;
+}
+
+static efpak_chunk_t* find_chunk
+(efpak_package_t* pkg, const efpak_header_t* h, size_t index)
+{
+  /* ASSUME: pkg->lock held */
+
+  efpak_chunk_t* c;
+  size_t i;
+
+  for (i = 0; i != pkg->chunk_count; ++i)
+  {
+    c = &pkg->chunks[i];
+    if ((c->header == h) && (c->index == index)) return c;
+  }
+
+  return NULL;
+}
+
+static efpak_chunk_t* get_lru_chunk(efpak_package_t* pkg)
+{
+  /* ASSUME: pkg->lock held */
+
+  efpak_chunk_t* lru = &pkg->chunks[0];
+  size_t i;
+
+  for (i = 1; i != pkg->chunk_count; ++i)
+  {
+    if (pkg->chunks[i].stamp < lru->stamp) lru = &pkg->chunks[i];
+  }
+
+  return lru;
+}
+
+int efpak_package_open(efpak_package_t* pkg, const char* path)
+{
+  size_t i;
+
+  if (map_file(path, &pkg->data, &pkg->size)) goto on_error_0;
+  if (index_blocks(pkg)) goto on_error_1;
+
+  pkg->chunk_count = chunk_count;
+  pkg->stamp = 0;
+
+  pkg->chunks = malloc(chunk_count * sizeof(efpak_chunk_t));
+  if (pkg->chunks == NULL) goto on_error_2;
+
+  for (i = 0; i != chunk_count; ++i)
+  {
+    pkg->chunks[i].header = NULL;
+    pkg->chunks[i].stamp = 0;
+    pkg->chunks[i].data = malloc(chunk_size);
+    if (pkg->chunks[i].data == NULL) goto on_error_3;
+  }
+
+  pthread_mutex_init(&pkg->lock, NULL);
+
+  return 0;
+
+ on_error_3:
+  for (; i; --i) free(pkg->chunks[i - 1].data);
+  free(pkg->chunks);
+ on_error_2:
+  free(pkg->headers);
+ on_error_1:
+  unmap_file(pkg->data, pkg->size);
+ on_error_0:
+  return -1;
+}
+
+void efpak_package_close(efpak_package_t* pkg)
+{
+  /* ASSUME: all the package cursors are finalized */
+
+  size_t i;
+
+  pthread_mutex_destroy(&pkg->lock);
+  for (i = 0; i != pkg->chunk_count; ++i) free(pkg->chunks[i].data);
+  free(pkg->chunks);
+  free(pkg->headers);
+  unmap_file(pkg->data, pkg->size);
+}
+
+const efpak_header_t* efpak_package_get_block
+(const efpak_package_t* pkg, size_t i)
+{
+  /* return the i-th block header, or NULL if none */
+
+  if (i >= pkg->block_count) return NULL;
+  return pkg->headers[i];
+}
+
+int efpak_package_open_file
+(efpak_package_t* pkg, efpak_file_t* file, const char* path)
+{
+  /* open the file block whose destination is path */
+
+  const efpak_header_t* h;
+  size_t i;
+
+  if (efpak_istream_init_with_package(&file->is, pkg)) goto on_error_0;
+
+  if (efpak_istream_find_file(&file->is, path, &i)) goto on_error_1;
+  if (i == (size_t)-1) goto on_error_1;
+
+  h = efpak_package_get_block(pkg, i);
+  if (h == NULL) goto on_error_1;
+
+  if (efpak_header_get_size(h) > (uint64_t)SIZE_MAX) goto on_error_1;
+
+  file->buf = malloc(chunk_size);
+  if (file->buf == NULL) goto on_error_1;
+
+  efpak_istream_set_checkpoints(&file->is, file_point_span, file_point_size);
+
+  file->package = pkg;
+  file->header = h;
+  file->size = (size_t)efpak_header_get_size(h);
+
+  return 0;
+
+ on_error_1:
+  efpak_istream_fini(&file->is);
+ on_error_0:
+  return -1;
+}
+
+void efpak_file_close(efpak_file_t* file)
+{
+  free(file->buf);
+  efpak_istream_fini(&file->is);
+}
+
+int efpak_file_pread
+(efpak_file_t* file, uint8_t* buf, size_t* size, size_t off)
+{
+  /* read up to size bytes at off. size is set to the read size, */
+  /* short only at the end of the file. files of a package can be */
+  /* read concurrently, but a file from one thread at a time. */
+
+  efpak_package_t* const pkg = file->package;
+  efpak_chunk_t* c;
+  size_t csize;
+  size_t index;
+  size_t i;
+  size_t n;
+  size_t x;
+
+  if (off >= file->size)
+  {
+    *size = 0;
+    return 0;
+  }
+
+  if (*size > (file->size - off)) *size = file->size - off;
+
+  for (i = 0; i != *size; i += n, off += n)
+  {
+    index = off / chunk_size;
+    x = off % chunk_size;
+    n = chunk_size - x;
+    if (n > (*size - i)) n = *size - i;
+
+    pthread_mutex_lock(&pkg->lock);
+
+    c = find_chunk(pkg, file->header, index);
+    if (c != NULL)
+    {
+      c->stamp = ++pkg->stamp;
+      if ((x + n) <= c->size) memcpy(buf + i, c->data + x, n);
+      else n = 0;
+      pthread_mutex_unlock(&pkg->lock);
+      if (n == 0) return -1;
+      continue ;
+    }
+
+    pthread_mutex_unlock(&pkg->lock);
+
+    /* decode without holding the lock */
+    if (decode_chunk(file, index, &csize)) return -1;
+    if ((x + n) > csize) return -1;
+    memcpy(buf + i, file->buf + x, n);
+
+    pthread_mutex_lock(&pkg->lock);
+    c = get_lru_chunk(pkg);
+    c->header = file->header;
+    c->index = index;
+    c->size = csize;
+    c->stamp = ++pkg->stamp;
+    memcpy(c->data, file->buf, csize);
+    pthread_mutex_unlock(&pkg->lock);
+  }
+
+  return 0;
+}
+
+
+/* output stream exported routines */
+
+/* window used to copy uncompressed block data */
+static const size_t deflate_window_size = 1024 * 1024;
+
+static int write_buf(int fd, const uint8_t* buf, size_t size)
+{
+  ssize_t res;
+
+  while (size)
+  {
+    res = write(fd, buf, size);
+    if (res <= 0) return -1;
+    buf += (size_t)res;
+    size -= (size_t)res;
+  }
+
+  return 0;
+}
+
+/* block data is compressed by fixed size chunks, possibly in */
+/* parallel, and the chunks are concatenated in order. the output */
+/* only depends on the input and not on the thread count. */
+
+/* raw data size between chunk index restart points, or the chunk */
+/* size if larger. one of them is a multiple of the other. */
+static const size_t comp_index_span = 1024 * 1024;
+
+typedef struct comp_slot
+{
+  /* codec context */
+  z_stream z;
+  void* ctx;
+
+  /* input chunk and preceding dictionary */
+  const uint8_t* idata;
+  size_t isize;
+  size_t dict_size;
+
+  uint8_t* obuf;
+  size_t osize;
+  size_t obuf_size;
+
+  uLong crc;
+  int err;
+
+} comp_slot_t;
+
+typedef struct codec
+{
+  efpak_bcomp_t comp;
+
+  size_t chunk_size;
+
+  /* previous data used as dictionary, 0 for independent chunks */
+  size_t dict_size;
+
+  /* set the slot obuf_size */
+  int (*init)(comp_slot_t*, int, size_t);
+  void (*fini)(comp_slot_t*);
+  void (*compress)(comp_slot_t*);
+
+  /* stream header and trailer */
+  int (*head)(efpak_ostream_t*, uint64_t*);
+  int (*tail)(efpak_ostream_t*, uLong, uint64_t, uint64_t*);
+
+  /* decoder dictionary size for a level and chunk size, */
+  /* NULL if not recorded */
+  uint32_t (*dict)(int, size_t);
+
+} codec_t;
+
+typedef struct comp_batch
+{
+  const codec_t* codec;
+
+  comp_slot_t* slots;
+  size_t slot_count;
+
+  /* dictionary followed by slot_count input chunks */
+  uint8_t* ibuf;
+
+} comp_batch_t;
+
+
+/* zlib codec. as in pigz, each chunk is a raw deflate stream primed */
+/* with the previous chunk window and ended by a sync flush, so that */
+/* chunks concatenate into a single gzip member. */
+
+/* gzip member header and final empty block */
+static const uint8_t deflate_gzip_header[] =
+{ 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03 };
+static const uint8_t deflate_last_block[] = { 0x03, 0x00 };
+
+static int deflate_slot_init(comp_slot_t* slot, int level, size_t chunk_size)
+{
+  z_stream* const z = &slot->z;
+
+  if (level == 0) level = Z_DEFAULT_COMPRESSION;
+
+  z->zalloc = Z_NULL;
+  z->zfree = Z_NULL;
+  z->opaque = Z_NULL;
+
+  if (deflateInit2
+      (z, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+
+  /* room for the sync flush marker */
+  slot->obuf_size = deflateBound(z, chunk_size) + 16;
+
+  return 0;
+}
+
+static void deflate_slot_fini(comp_slot_t* slot)
+{
+  deflateEnd(&slot->z);
+}
+
+static void deflate_chunk(comp_slot_t* slot)
+{
+  z_stream* const z = &slot->z;
+
+  if (deflateReset(z) != Z_OK) return ;
+
+  if (slot->dict_size)
+  {
+    const uint8_t* const dict = slot->idata - slot->dict_size;
+    if (deflateSetDictionary(z, dict, (uInt)slot->dict_size) != Z_OK)
+      return ;
+  }
+
+  z->next_in = (Bytef*)slot->idata;
+  z->avail_in = (uInt)slot->isize;
+  z->next_out = (Bytef*)slot->obuf;
+  z->avail_out = (uInt)slot->obuf_size;
+
+  if (deflate(z, Z_SYNC_FLUSH) != Z_OK) return ;
+
+  /* obuf_size is an upper bound, a full buffer means failure */
+  if (z->avail_in || (z->avail_out == 0)) return ;
+
+  slot->osize = slot->obuf_size - (size_t)z->avail_out;
+  slot->err = 0;
+}
+
+static int deflate_head(efpak_ostream_t* os, uint64_t* osize)
+{
+  const size_t size = sizeof(deflate_gzip_header);
+  if (write_buf(os->fd, deflate_gzip_header, size)) return -1;
+  *osize += (uint64_t)size;
+  return 0;
+}
+
+static int deflate_tail
+(efpak_ostream_t* os, uLong crc, uint64_t isize, uint64_t* osize)
+{
+  /* final block and gzip trailer */
+
+  uint8_t trailer[8];
+  size_t i;
+
+  if (write_buf(os->fd, deflate_last_block, sizeof(deflate_last_block)))
+    return -1;
+
+  for (i = 0; i != 4; ++i) trailer[0 + i] = (uint8_t)(crc >> (i * 8));
+  for (i = 0; i != 4; ++i) trailer[4 + i] = (uint8_t)(isize >> (i * 8));
+  if (write_buf(os->fd, trailer, sizeof(trailer))) return -1;
+
+  *osize += sizeof(deflate_last_block) + sizeof(trailer);
+
+  return 0;
+}
+
+static const codec_t deflate_codec =
+{
+  EFPAK_BCOMP_ZLIB,
+  128 * 1024,
+  32 * 1024,
+  deflate_slot_init,
+  deflate_slot_fini,
+  deflate_chunk,
+  deflate_head,
+  deflate_tail,
+  NULL
+};
+
+
+#ifdef CONFIG_ZSTD
+
+/* zstd codec. each chunk is an independent frame, and a sequence */
+/* of frames is a valid zstd stream. */
+
+static int zstd_slot_init(comp_slot_t* slot, int level, size_t chunk_size)
+{
+  ZSTD_CCtx* const cctx = ZSTD_createCCtx();
+  size_t err;
+
+  if (cctx == NULL) return -1;
+
+  if (level == 0) level = ZSTD_CLEVEL_DEFAULT;
+
+  err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  if (ZSTD_isError(err)) goto on_error;
+  err = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+  if (ZSTD_isError(err)) goto on_error;
+
+  slot->ctx = cctx;
+  slot->obuf_size = ZSTD_compressBound(chunk_size);
+
+  return 0;
+
+ on_error:
+  ZSTD_freeCCtx(cctx);
+  return -1;
+}
+
+static void zstd_slot_fini(comp_slot_t* slot)
+{
+  ZSTD_freeCCtx(slot->ctx);
+}
+
+static void zstd_chunk(comp_slot_t* slot)
+{
+  const size_t n = ZSTD_compress2
+    (slot->ctx, slot->obuf, slot->obuf_size, slot->idata, slot->isize);
+
+  if (ZSTD_isError(n)) return ;
+
+  slot->osize = n;
+  slot->err = 0;
+}
+
+static const codec_t zstd_codec =
+{
+  EFPAK_BCOMP_ZSTD,
+  1024 * 1024,
+  0,
+  zstd_slot_init,
+  zstd_slot_fini,
+  zstd_chunk,
+  NULL,
+  NULL,
+  NULL
+};
+
+#endif /* CONFIG_ZSTD */
+
+
+#ifdef CONFIG_LZ4
+
+/* lz4 codec. each chunk is an independent frame, concatenated */
+/* frames are a valid lz4 stream. */
+
+typedef struct lz4_slot
+{
+  LZ4F_cctx* cctx;
+  LZ4F_preferences_t prefs;
+} lz4_slot_t;
+
+static int lz4_slot_init(comp_slot_t* slot, int level, size_t chunk_size)
+{
+  lz4_slot_t* const lz = malloc(sizeof(lz4_slot_t));
+
+  if (lz == NULL) goto on_error_0;
+
+  if (LZ4F_isError(LZ4F_createCompressionContext(&lz->cctx, LZ4F_VERSION)))
+    goto on_error_1;
+
+  memset(&lz->prefs, 0, sizeof(lz->prefs));
+  lz->prefs.frameInfo.blockSizeID = LZ4F_max1MB;
+  lz->prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+  lz->prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+  lz->prefs.compressionLevel = level;
+
+  slot->ctx = lz;
+  slot->obuf_size = LZ4F_compressFrameBound(chunk_size, &lz->prefs);
+
+  return 0;
+
+ on_error_1:
+  free(lz);
+ on_error_0:
+  return -1;
+}
+
+static void lz4_slot_fini(comp_slot_t* slot)
+{
+  lz4_slot_t* const lz = slot->ctx;
+  LZ4F_freeCompressionContext(lz->cctx);
+  free(lz);
+}
+
+static void lz4_chunk(comp_slot_t* slot)
+{
+  lz4_slot_t* const lz = slot->ctx;
+  size_t osize = 0;
+  size_t n;
+
+  n = LZ4F_compressBegin(lz->cctx, slot->obuf, slot->obuf_size, &lz->prefs);
+  if (LZ4F_isError(n)) return ;
+  osize += n;
+
+  n = LZ4F_compressUpdate
+  (
+   lz->cctx,
+   slot->obuf + osize, slot->obuf_size - osize,
+   slot->idata, slot->isize,
+   NULL
+  );
+  if (LZ4F_isError(n)) return ;
+  osize += n;
+
+  n = LZ4F_compressEnd
+    (lz->cctx, slot->obuf + osize, slot->obuf_size - osize, NULL);
+  if (LZ4F_isError(n)) return ;
+  osize += n;
+
+  slot->osize = osize;
+  slot->err = 0;
+}
+
+static const codec_t lz4_codec =
+{
+  EFPAK_BCOMP_LZ4,
+  1024 * 1024,
+  0,
+  lz4_slot_init,
+  lz4_slot_fini,
+  lz4_chunk,
+  NULL,
+  NULL,
+  NULL
+};
+
+#endif /* CONFIG_LZ4 */
+
+
+#ifdef CONFIG_XZ
+
+/* xz codec. each chunk is an independent stream, and concatenated */
+/* streams are a valid xz file. chunks are larger than for other */
+/* codecs as the ratio depends on the dictionary, which is useless */
+/* beyond the chunk size. */
+
+typedef struct xz_slot
+{
+  lzma_stream strm;
+  lzma_options_lzma opts;
+  lzma_filter filters[2];
+} xz_slot_t;
+
+static int xz_get_opts
+(lzma_options_lzma* opts, int level, size_t chunk_size)
+{
+  if (level == 0) level = LZMA_PRESET_DEFAULT;
+  if ((level < 0) || (level > 9)) return -1;
+
+  if (lzma_lzma_preset(opts, (uint32_t)level)) return -1;
+
+  /* no match can be farther than the chunk start */
+  if (opts->dict_size > chunk_size) opts->dict_size = (uint32_t)chunk_size;
+
+  return 0;
+}
+
+static uint32_t xz_dict(int level, size_t chunk_size)
+{
+  lzma_options_lzma opts;
+  if (xz_get_opts(&opts, level, chunk_size)) return 0;
+  return opts.dict_size;
+}
+
+static int xz_slot_init(comp_slot_t* slot, int level, size_t chunk_size)
+{
+  xz_slot_t* const xz = malloc(sizeof(xz_slot_t));
+
+  if (xz == NULL) goto on_error_0;
+
+  if (xz_get_opts(&xz->opts, level, chunk_size)) goto on_error_1;
+
+  xz->filters[0].id = LZMA_FILTER_LZMA2;
+  xz->filters[0].options = &xz->opts;
+  xz->filters[1].id = LZMA_VLI_UNKNOWN;
+  xz->filters[1].options = NULL;
+  xz->strm = xz_stream_init;
+
+  slot->ctx = xz;
+  slot->obuf_size = lzma_stream_buffer_bound(chunk_size);
+
+  return 0;
+
+ on_error_1:
+  free(xz);
+ on_error_0:
+  return -1;
+}
+
+static void xz_slot_fini(comp_slot_t* slot)
+{
+  xz_slot_t* const xz = slot->ctx;
+  lzma_end(&xz->strm);
+  free(xz);
+}
+
+static void xz_chunk(comp_slot_t* slot)
+{
+  xz_slot_t* const xz = slot->ctx;
+  lzma_stream* const strm = &xz->strm;
+
+  /* reuse the encoder memory of previous chunks */
+  if (lzma_stream_encoder(strm, xz->filters, LZMA_CHECK_CRC32)) return ;
+
+  strm->next_in = slot->idata;
+  strm->avail_in = slot->isize;
+  strm->next_out = slot->obuf;
+  strm->avail_out = slot->obuf_size;
+
+  if (lzma_code(strm, LZMA_FINISH) != LZMA_STREAM_END) return ;
+
+  slot->osize = slot->obuf_size - strm->avail_out;
+  slot->err = 0;
+}
+
+static const codec_t xz_codec =
+{
+  EFPAK_BCOMP_XZ,
+  8 * 1024 * 1024,
+  0,
+  xz_slot_init,
+  xz_slot_fini,
+  xz_chunk,
+  NULL,
+  NULL,
+  xz_dict
+};
+
+#endif /* CONFIG_XZ */
+
+
+static const codec_t* get_codec(efpak_bcomp_t comp)
+{
+  switch (comp)
+  {
+  case EFPAK_BCOMP_ZLIB: return &deflate_codec;
+#ifdef CONFIG_ZSTD
+  case EFPAK_BCOMP_ZSTD: return &zstd_codec;
+#endif /* CONFIG_ZSTD */
+#ifdef CONFIG_LZ4
+  case EFPAK_BCOMP_LZ4: return &lz4_codec;
+#endif /* CONFIG_LZ4 */
+#ifdef CONFIG_XZ
+  case EFPAK_BCOMP_XZ: return &xz_codec;
+#endif /* CONFIG_XZ */
+  default: break ;
+  }
+
+  return NULL;
+}
+
+static size_t comp_get_span(const codec_t* codec)
+{
+  if (codec->chunk_size > comp_index_span) return codec->chunk_size;
+  return comp_index_span;
+}
+
+static unsigned int comp_is_span_chunk(const codec_t* codec, size_t i)
+{
+  return ((i * codec->chunk_size) % comp_get_span(codec)) == 0;
+}
+
+static void comp_chunk(void* arg, size_t i)
+{
+  comp_batch_t* const batch = arg;
+  comp_slot_t* const slot = &batch->slots[i];
+
+  slot->err = -1;
+  slot->crc = crc32(0, slot->idata, (uInt)slot->isize);
+  batch->codec->compress(slot);
+}
+
+
+/* block data source. for sparse blocks, the block data is the */
+/* concatenation of the input file data extents. */
+
+typedef struct data_src
+{
+  int fd;
+
+  /* data extents, or NULL if not sparse */
+  const efpak_sparse_ext_t* sparse;
+
+  /* offset in block data */
+  uint64_t off;
+
+} data_src_t;
+
+static size_t find_data_extent(const efpak_sparse_ext_t* sparse, uint64_t off)
+{
+  /* find the last extent whose data_off <= off */
+
+  size_t lo = 0;
+  size_t hi = sparse->count;
+  size_t mid;
+
+  while ((hi - lo) > 1)
+  {
+    mid = lo + (hi - lo) / 2;
+    if (sparse->extents[mid].data_off <= off) lo = mid;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+static size_t src_pread
+(const data_src_t* src, uint8_t* buf, size_t size, uint64_t off)
+{
+  /* read up to size bytes of block data at off, short only at end */
+
+  const efpak_sparse_ext_t* const sparse = src->sparse;
+  const efpak_extent_t* e;
+  uint64_t x;
+  size_t i;
+  size_t k;
+  size_t n;
+
+  if (sparse == NULL) return pread_full(src->fd, buf, size, off);
+
+  /* extents were scanned before, a short read is an error */
+  k = find_data_extent(sparse, off);
+  for (i = 0; (i != size) && (k < sparse->count); i += n, ++k)
+  {
+    e = &sparse->extents[k];
+    x = off + i - e->data_off;
+    n = size - i;
+    if ((uint64_t)n > (e->size - x)) n = (size_t)(e->size - x);
+    if (pread_full(src->fd, buf + i, n, e->off + x) != n) return (size_t)-1;
+  }
+
+  return i;
+}
+
+static size_t src_read(data_src_t* src, uint8_t* buf, size_t size)
+{
+  const size_t n = src_pread(src, buf, size, src->off);
+  if (n != (size_t)-1) src->off += (uint64_t)n;
+  return n;
+}
+
+
+/* sparse block scanning. zero runs are detected by blocks, and */
+/* those shorter than sparse_min_hole are kept as data, to limit */
+/* the extent count. */
+
+static const size_t sparse_block_size = 4096;
+static const size_t sparse_min_hole = 64 * 1024;
+
+typedef uint64_t zero_vec_t __attribute__((vector_size(16)));
+
+static unsigned int is_zero(const uint8_t* buf, size_t size)
+{
+  /* vectors are or'ed without early exit, so that the loop is */
+  /* vectorized. buf must be aligned on zero_vec_t. */
+
+  const zero_vec_t* const v = (const zero_vec_t*)buf;
+  const size_t n = size / sizeof(zero_vec_t);
+  zero_vec_t x = { 0, 0 };
+  uint8_t y = 0;
+  size_t i;
+
+  for (i = 0; i != n; ++i) x |= v[i];
+  for (i = n * sizeof(zero_vec_t); i != size; ++i) y |= buf[i];
+
+  return ((x[0] | x[1]) == 0) && (y == 0);
+}
+
+static int add_extent
+(efpak_sparse_ext_t** sparsep, size_t* max_count, uint64_t off, size_t size)
+{
+  efpak_sparse_ext_t* sparse = *sparsep;
+  efpak_extent_t* e;
+
+  /* merge with the previous extent if the hole is too small */
+  if (sparse->count)
+  {
+    e = &sparse->extents[sparse->count - 1];
+    if ((off - (e->off + e->size)) < (uint64_t)sparse_min_hole)
+    {
+      e->size = off + size - e->off;
+      return 0;
+    }
+  }
+
+  if (sparse->count == *max_count)
+  {
+    *max_count *= 2;
+    sparse = realloc(sparse, offsetof(efpak_sparse_ext_t, extents) +
+		     *max_count * sizeof(efpak_extent_t));
+    if (sparse == NULL) return -1;
+    *sparsep = sparse;
+  }
+
+  e = &sparse->extents[sparse->count++];
+  e->off = off;
+  e->size = (uint64_t)size;
+
+  return 0;
+}
+
+static efpak_sparse_ext_t* alloc_sparse(size_t max_count)
+{
+  const size_t size = offsetof(efpak_sparse_ext_t, extents);
+  efpak_sparse_ext_t* const sparse =
+    malloc(size + max_count * sizeof(efpak_extent_t));
+  if (sparse != NULL) sparse->count = 0;
+  return sparse;
+}
+
+static void end_sparse
+(efpak_sparse_ext_t* sparse, uint64_t size, uint32_t flags)
+{
+  /* compute data offsets and fill the extension header */
+
+  uint64_t data_off = 0;
+  size_t i;
+
+  for (i = 0; i != sparse->count; ++i)
+  {
+    sparse->extents[i].data_off = data_off;
+    data_off += sparse->extents[i].size;
+  }
+
+  sparse->ext.type = EFPAK_EXT_SPARSE;
+  sparse->ext.size = (uint32_t)(offsetof(efpak_sparse_ext_t, extents) +
+				sparse->count * sizeof(efpak_extent_t));
+  sparse->size = size;
+  sparse->flags = flags;
+}
+
+static efpak_sparse_ext_t* scan_sparse(int fd, uint64_t size)
+{
+  /* return the sparse extension describing the file data extents */
+
+  efpak_sparse_ext_t* sparse;
+  size_t max_count = 64;
+  uint8_t* buf;
+  uint64_t off;
+  size_t bsize;
+  size_t n;
+  size_t i;
+
+  sparse = alloc_sparse(max_count);
+  if (sparse == NULL) goto on_error_0;
+
+  /* ASSUME((deflate_window_size % sparse_block_size) == 0) */
+  buf = malloc(deflate_window_size);
+  if (buf == NULL) goto on_error_1;
+
+  for (off = 0; off != size; off += (uint64_t)n)
+  {
+    n = deflate_window_size;
+    if ((uint64_t)n > (size - off)) n = (size_t)(size - off);
+    if (pread_full(fd, buf, n, off) != n) goto on_error_2;
+
+    for (i = 0; i != n; i += bsize)
+    {
+      bsize = n - i;
+      if (bsize > sparse_block_size) bsize = sparse_block_size;
+      if (is_zero(buf + i, bsize)) continue ;
+      if (add_extent(&sparse, &max_count, off + i, bsize)) goto on_error_2;
+    }
+  }
+
+  free(buf);
+
+  end_sparse(sparse, size, 0);
+
+  return sparse;
+
+ on_error_2:
+  free(buf);
+ on_error_1:
+  free(sparse);
+ on_error_0:
+  return NULL;
+}
+
+
+/* filesystem used blocks. the allocation maps of known filesystems */
+/* give the extents to store, unused blocks being holes. */
+
+static uint16_t get_uint16_le(const uint8_t* buf)
+{
+  return (uint16_t)(buf[0] | (buf[1] << 8));
+}
+
+static uint32_t get_uint32_le(const uint8_t* buf)
+{
+  return
+    ((uint32_t)buf[0] << 0) | ((uint32_t)buf[1] << 8) |
+    ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static int add_used_run
+(
+ efpak_sparse_ext_t** sparsep, size_t* max_count,
+ uint64_t off, uint64_t size
+)
+{
+  /* add_extent size is a size_t, split if needed */
+
+  size_t n;
+
+  for (; size; size -= (uint64_t)n, off += (uint64_t)n)
+  {
+    n = (size_t)-1;
+    if ((uint64_t)n > size) n = (size_t)size;
+    if (add_extent(sparsep, max_count, off, n)) return -1;
+  }
+
+  return 0;
+}
+
+static int scan_ext2
+(int fd, uint64_t size, efpak_sparse_ext_t** sparsep, size_t* max_count)
+{
+  /* return 1 if not an ext2 or ext3 filesystem, as supported here */
+
+  uint8_t sb[1024];
+  uint8_t* gdt = NULL;
+  uint8_t* bitmap = NULL;
+  uint64_t block_size;
+  uint64_t block_count;
+  uint64_t first_block;
+  uint64_t group_size;
+  uint64_t group_count;
+  uint64_t block;
+  uint64_t gdt_size;
+  uint32_t incompat;
+  uint32_t ro_compat;
+  uint64_t g;
+  uint64_t i;
+  uint64_t n;
+  int err = -1;
+
+  if (pread_full(fd, sb, sizeof(sb), 1024) != sizeof(sb)) return 1;
+  if (get_uint16_le(sb + 56) != 0xef53) return 1;
+
+  /* 64 bit block numbers and meta block groups not supported */
+  incompat = get_uint32_le(sb + 96);
+  if (incompat & (0x0010 | 0x0080)) return 1;
+
+  ro_compat = get_uint32_le(sb + 100);
+
+  if (get_uint32_le(sb + 24) > 6) return 1;
+  block_size = (uint64_t)1024 << get_uint32_le(sb + 24);
+  block_count = (uint64_t)get_uint32_le(sb + 4);
+  first_block = (uint64_t)get_uint32_le(sb + 20);
+  group_size = (uint64_t)get_uint32_le(sb + 32);
+
+  if ((group_size == 0) || (group_size > (block_size * 8))) return 1;
+  if (first_block >= block_count) return 1;
+  if ((block_count * block_size) > size) return 1;
+
+  group_count = (block_count - first_block + group_size - 1) / group_size;
+
+  /* group descriptors follow the superblock */
+  gdt_size = group_count * 32;
+  gdt = malloc((size_t)gdt_size);
+  if (gdt == NULL) goto on_error;
+  if (pread_full(fd, gdt, (size_t)gdt_size, (first_block + 1) * block_size)
+      != (size_t)gdt_size)
+    goto on_error;
+
+  bitmap = malloc((size_t)block_size);
+  if (bitmap == NULL) goto on_error;
+
+  /* blocks before the first group */
+  if (add_used_run(sparsep, max_count, 0, first_block * block_size))
+    goto on_error;
+
+  for (g = 0; g != group_count; ++g)
+  {
+    const uint8_t* const gd = gdt + g * 32;
+
+    block = first_block + g * group_size;
+    n = block_count - block;
+    if (n > group_size) n = group_size;
+
+    /* uninitialized bitmap, keep the whole group */
+    if ((ro_compat & (0x0010 | 0x0400)) && (get_uint16_le(gd + 18) & 0x2))
+    {
+      if (add_used_run(sparsep, max_count, block * block_size, n * block_size))
+	goto on_error;
+      continue ;
+    }
+
+    if (pread_full
+	(fd, bitmap, (size_t)block_size,
+	 (uint64_t)get_uint32_le(gd) * block_size) != (size_t)block_size)
+      goto on_error;
+
+    for (i = 0; i != n; ++i)
+    {
+      if ((bitmap[i / 8] & (1 << (i % 8))) == 0) continue ;
+      if (add_used_run
+	  (sparsep, max_count, (block + i) * block_size, block_size))
+	goto on_error;
+    }
+  }
+
+  err = 0;
+
+ on_error:
+  free(bitmap);
+  free(gdt);
+  return err;
+}
+
+static int scan_fat
+(int fd, uint64_t size, efpak_sparse_ext_t** sparsep, size_t* max_count)
+{
+  /* return 1 if not a fat filesystem */
+
+  uint8_t bs[512];
+  uint8_t* fat = NULL;
+  uint64_t sector_size;
+  uint64_t cluster_size;
+  uint64_t fat_size;
+  uint64_t sector_count;
+  uint64_t data_sector;
+  uint64_t cluster_count;
+  uint64_t root_size;
+  uint64_t i;
+  uint32_t x;
+  int err = -1;
+
+  if (pread_full(fd, bs, sizeof(bs), 0) != sizeof(bs)) return 1;
+  if ((bs[510] != 0x55) || (bs[511] != 0xaa)) return 1;
+
+  sector_size = (uint64_t)get_uint16_le(bs + 11);
+  if ((sector_size < 512) || (sector_size > 4096)) return 1;
+  if (sector_size & (sector_size - 1)) return 1;
+
+  cluster_size = (uint64_t)bs[13];
+  if ((cluster_size == 0) || (cluster_size & (cluster_size - 1))) return 1;
+  if (bs[16] == 0) return 1;
+
+  fat_size = (uint64_t)get_uint16_le(bs + 22);
+  if (fat_size == 0) fat_size = (uint64_t)get_uint32_le(bs + 36);
+  sector_count = (uint64_t)get_uint16_le(bs + 19);
+  if (sector_count == 0) sector_count = (uint64_t)get_uint32_le(bs + 32);
+  root_size = ((uint64_t)get_uint16_le(bs + 17) * 32 + sector_size - 1);
+  root_size /= sector_size;
+
+  /* reserved sectors, fats and fat12/16 root directory */
+  data_sector = (uint64_t)get_uint16_le(bs + 14);
+  data_sector += (uint64_t)bs[16] * fat_size + root_size;
+
+  if ((fat_size == 0) || (data_sector >= sector_count)) return 1;
+  if ((sector_count * sector_size) > size) return 1;
+
+  cluster_count = (sector_count - data_sector) / cluster_size;
+
+  fat = malloc((size_t)(fat_size * sector_size));
+  if (fat == NULL) goto on_error;
+  if (pread_full
+      (fd, fat, (size_t)(fat_size * sector_size),
+       (uint64_t)get_uint16_le(bs + 14) * sector_size) !=
+      (size_t)(fat_size * sector_size))
+    goto on_error;
+
+  if (add_used_run(sparsep, max_count, 0, data_sector * sector_size))
+    goto on_error;
+
+  /* clusters are numbered from 2 */
+  for (i = 0; i != cluster_count; ++i)
+  {
+    const uint64_t k = i + 2;
+
+    if (cluster_count < 4085)
+    {
+      if ((k + k / 2 + 2) > (fat_size * sector_size)) break ;
+      x = (uint32_t)get_uint16_le(fat + k + k / 2);
+      x = (k & 1) ? (x >> 4) : (x & 0xfff);
+    }
+    else if (cluster_count < 65525)
+    {
+      if ((k * 2 + 2) > (fat_size * sector_size)) break ;
+      x = (uint32_t)get_uint16_le(fat + k * 2);
+    }
+    else
+    {
+      if ((k * 4 + 4) > (fat_size * sector_size)) break ;
+      x = get_uint32_le(fat + k * 4) & 0x0fffffff;
+    }
+
+    if (x == 0) continue ;
+
+    if (add_used_run
+	(sparsep, max_count,
+	 (data_sector + i * cluster_size) * sector_size,
+	 cluster_size * sector_size))
+      goto on_error;
+  }
+
+  err = 0;
+
+ on_error:
+  free(fat);
+  return err;
+}
+
+static int scan_fs
+(int fd, uint64_t size, efpak_fsid_t fs_id, efpak_sparse_ext_t** sparsep)
+{
+  /* *sparsep set to the used extents, or NULL if the filesystem is */
+  /* not supported or not recognized */
+
+  size_t max_count = 64;
+  int err;
+
+  *sparsep = alloc_sparse(max_count);
+  if (*sparsep == NULL) return -1;
+
+  switch (fs_id)
+  {
+  case EFPAK_FSID_EXT2:
+  case EFPAK_FSID_EXT3:
+    err = scan_ext2(fd, size, sparsep, &max_count);
+    break ;
+
+  case EFPAK_FSID_VFAT:
+    err = scan_fat(fd, size, sparsep, &max_count);
+    break ;
+
+  default:
+    err = 1;
+    break ;
+  }
+
+  if (err)
+  {
+    free(*sparsep);
+    *sparsep = NULL;
+    return (err == 1) ? 0 : -1;
+  }
+
+  end_sparse(*sparsep, size, EFPAK_SPARSE_FLAG_UNUSED);
+
+  return 0;
+}
+
+static uint64_t get_sparse_data_size(const efpak_sparse_ext_t* sparse)
+{
+  const efpak_extent_t* e;
+  if (sparse->count == 0) return 0;
+  e = &sparse->extents[sparse->count - 1];
+  return e->data_off + e->size;
+}
+
+static void comp_batch_fini(comp_batch_t* batch, size_t n)
+{
+  /* n the count of initialized slots */
+
+  size_t i;
+
+  for (i = 0; i != n; ++i)
+  {
+    batch->codec->fini(&batch->slots[i]);
+    free(batch->slots[i].obuf);
+  }
+
+  free(batch->slots);
+  free(batch->ibuf);
+}
+
+static int comp_batch_init
+(comp_batch_t* batch, const codec_t* codec, int level, size_t slot_count)
+{
+  const size_t ibuf_size = codec->dict_size + slot_count * codec->chunk_size;
+  comp_slot_t* slot;
+  size_t i;
+
+  batch->codec = codec;
+  batch->slot_count = slot_count;
+
+  batch->ibuf = malloc(ibuf_size);
+  if (batch->ibuf == NULL) goto on_error_0;
+
+  batch->slots = malloc(slot_count * sizeof(comp_slot_t));
+  if (batch->slots == NULL) goto on_error_1;
+
+  for (i = 0; i != slot_count; ++i)
+  {
+    slot = &batch->slots[i];
+
+    if (codec->init(slot, level, codec->chunk_size)) goto on_error_2;
+
+    slot->obuf = malloc(slot->obuf_size);
+    if (slot->obuf == NULL)
+    {
+      codec->fini(slot);
+      goto on_error_2;
+    }
+  }
+
+  return 0;
+
+ on_error_2:
+  comp_batch_fini(batch, i);
+  return -1;
+ on_error_1:
+  free(batch->ibuf);
+ on_error_0:
+  return -1;
+}
+
+static int comp_data
+(
+ efpak_ostream_t* os, data_src_t* src,
+ const codec_t* codec, int level,
+ efpak_index_ext_t* index,
+ uint64_t* isize, uint64_t* osize
+)
+{
+  /* compress src into the output stream. memory usage depends on */
+  /* the thread count but not on the input size. if index is not */
+  /* NULL, a restart point is created and recorded every span. */
+
+  const size_t chunk_size = codec->chunk_size;
+  const size_t dict_max = codec->dict_size;
+  comp_batch_t batch;
+  comp_slot_t* slot;
+  uint8_t* ibuf;
+  size_t dict_size;
+  size_t chunk;
+  size_t size;
+  size_t n;
+  size_t i;
+  size_t k;
+  uLong crc;
+  int err = -1;
+
+  if (comp_batch_init(&batch, codec, level, os->thread_count))
+    goto on_error_0;
+
+  /* chunks start after the dictionary */
+  ibuf = batch.ibuf + dict_max;
+
+  *isize = 0;
+  *osize = 0;
+  crc = crc32(0, Z_NULL, 0);
+  dict_size = 0;
+  k = 0;
+
+  if ((codec->head != NULL) && codec->head(os, osize)) goto on_error_1;
+
+  while (1)
+  {
+    /* fill the batch chunks, the dictionary being kept in front */
+
+    size = src_read(src, ibuf, batch.slot_count * chunk_size);
+    if (size == (size_t)-1) goto on_error_1;
+    if (size == 0) break ;
+
+    for (n = 0; (n * chunk_size) < size; ++n)
+    {
+      slot = &batch.slots[n];
+      slot->idata = ibuf + n * chunk_size;
+      slot->isize = size - n * chunk_size;
+      if (slot->isize > chunk_size) slot->isize = chunk_size;
+      slot->dict_size = n ? dict_max : dict_size;
+
+      /* restart points do not depend on previous data */
+      chunk = (size_t)(*isize / chunk_size) + n;
+      if ((index != NULL) && comp_is_span_chunk(codec, chunk))
+	slot->dict_size = 0;
+    }
+
+    pool_run(os->pool, comp_chunk, &batch, n);
+
+    for (i = 0; i != n; ++i)
+    {
+      slot = &batch.slots[i];
+      if (slot->err) goto on_error_1;
+
+      chunk = (size_t)(*isize / chunk_size) + i;
+      if ((index != NULL) && comp_is_span_chunk(codec, chunk))
+      {
+	if (k == index->count) goto on_error_1;
+	index->entries[k].comp_off = *osize;
+	index->entries[k].raw_off = (uint64_t)chunk * chunk_size;
+	++k;
+      }
+
+      if (write_buf(os->fd, slot->obuf, slot->osize)) goto on_error_1;
+      crc = crc32_combine(crc, slot->crc, (z_off_t)slot->isize);
+      *osize += (uint64_t)slot->osize;
+    }
+
+    *isize += (uint64_t)size;
+
+    /* the last chunk window is the next batch dictionary */
+    if (dict_max)
+    {
+      slot = &batch.slots[n - 1];
+      dict_size = slot->dict_size + slot->isize;
+      if (dict_size > dict_max) dict_size = dict_max;
+      memmove
+	(ibuf - dict_size, slot->idata + slot->isize - dict_size, dict_size);
+    }
+
+    if (size != (batch.slot_count * chunk_size)) break ;
+  }
+
+  /* the input size changed since the index was allocated */
+  if ((index != NULL) && (k != index->count)) goto on_error_1;
+
+  if ((codec->tail != NULL) && codec->tail(os, crc, *isize, osize))
+    goto on_error_1;
+
+  err = 0;
+
+ on_error_1:
+  comp_batch_fini(&batch, batch.slot_count);
+ on_error_0:
+  return err;
+}
+
+static int copy_data(int ofd, data_src_t* src, uint64_t* size)
+{
+  uint8_t* buf;
+  size_t n;
+  int err = -1;
+
+  buf = malloc(deflate_window_size);
+  if (buf == NULL) goto on_error_0;
+
+  *size = 0;
+
+  while (1)
+  {
+    n = src_read(src, buf, deflate_window_size);
+    if (n == (size_t)-1) goto on_error_1;
+    if (n == 0) break ;
+    if (write_buf(ofd, buf, n)) goto on_error_1;
+    *size += (uint64_t)n;
+  }
+
+  err = 0;
+
+ on_error_1:
+  free(buf);
+ on_error_0:
+  return err;
+}
+
+static void init_header
+(efpak_header_t* h)
+{
+  h->vers = 0;
+}
+
+static int add_block
+(efpak_ostream_t* os, const efpak_header_t* header, const uint8_t* data)
+{
+  /* TODO: convert header fields if local endianness is not little */
+#if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
+#error "unsupported endianness"
+#endif
+
+  if (write_buf(os->fd, (const uint8_t*)header, header->header_size))
+    return -1;
+
+  if (data != NULL)
+  {
+    if (write_buf(os->fd, data, header->comp_data_size))
+      return -1;
+  }
+
+  return 0;
+}
+
+static efpak_header_t* make_ext_header
+(
+ efpak_ostream_t* os,
+ const efpak_header_t* h,
+ const codec_t* codec, int level, uint64_t raw_size,
+ const efpak_sparse_ext_t* sparse
+)
+{
+  /* return a copy of h using codec, or no compression if NULL, */
+  /* with room for the extensions needed to store the block data. */
+  /* sparse is copied if not NULL. */
+
+  efpak_header_t* xh;
+  efpak_index_ext_t* index;
+  efpak_dict_ext_t* dict;
+  size_t index_size = 0;
+  size_t dict_size = 0;
+  size_t sparse_size = 0;
+  size_t count = 0;
+  size_t span;
+  size_t off;
+
+  if ((codec != NULL) && (os->flags & EFPAK_OSTREAM_FLAG_INDEX))
+  {
+    span = comp_get_span(codec);
+    count = (size_t)((raw_size + span - 1) / span);
+    if (count) index_size = offsetof(efpak_index_ext_t, entries);
+    index_size += count * sizeof(efpak_index_entry_t);
+  }
+
+  if ((codec != NULL) && (codec->dict != NULL))
+    dict_size = sizeof(efpak_dict_ext_t);
+
+  if (sparse != NULL) sparse_size = sparse->ext.size;
+
+  xh = malloc(h->header_size + index_size + dict_size + sparse_size);
+  if (xh == NULL) return NULL;
+
+  memcpy(xh, h, h->header_size);
+  xh->comp = (codec != NULL) ? codec->comp : EFPAK_BCOMP_NONE;
+  xh->header_size = h->header_size + index_size + dict_size + sparse_size;
+
+  off = h->header_size;
+
+  if (index_size)
+  {
+    index = (efpak_index_ext_t*)((uint8_t*)xh + off);
+    index->ext.type = EFPAK_EXT_INDEX;
+    index->ext.size = (uint32_t)index_size;
+    index->count = (uint32_t)count;
+    memset(index->entries, 0, count * sizeof(efpak_index_entry_t));
+    off += index_size;
+  }
+
+  if (dict_size)
+  {
+    dict = (efpak_dict_ext_t*)((uint8_t*)xh + off);
+    dict->ext.type = EFPAK_EXT_DICT;
+    dict->ext.size = (uint32_t)dict_size;
+    dict->dict_size = codec->dict(level, codec->chunk_size);
+    off += dict_size;
+  }
+
+  if (sparse_size) memcpy((uint8_t*)xh + off, sparse, sparse_size);
+
+  return xh;
+}
+
+/* adaptive codec selection. the block compressibility is estimated */
+/* by compressing samples spread over the input file. */
+
+static const size_t sample_size = 64 * 1024;
+static const size_t sample_count = 8;
+
+typedef struct comp_choice
+{
+  efpak_bcomp_t comp;
+  int level;
+} comp_choice_t;
+
+/* by increasing decoding cost */
+static const comp_choice_t comp_choices[] =
+{
+  { EFPAK_BCOMP_LZ4, 0 },
+  { EFPAK_BCOMP_ZSTD, 0 },
+  { EFPAK_BCOMP_ZSTD, 19 },
+  { EFPAK_BCOMP_ZLIB, 0 },
+  { EFPAK_BCOMP_XZ, 0 }
+};
+
+static int read_samples(const data_src_t* src, uint64_t size, uint8_t* buf)
+{
+  /* ASSUME(size >= sample_size) */
+
+  const uint64_t last = size - (uint64_t)sample_size;
+  uint64_t off;
+  size_t i;
+
+  for (i = 0; i != sample_count; ++i)
+  {
+    off = (last * i) / (sample_count - 1);
+    if (src_pread(src, buf + i * sample_size, sample_size, off) !=
+	sample_size)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int sample_codec
+(const codec_t* codec, int level, const uint8_t* buf, uint64_t* osize)
+{
+  /* compress the samples as independent chunks */
+
+  comp_slot_t slot;
+  size_t i;
+  int err = -1;
+
+  if (codec->init(&slot, level, sample_size)) goto on_error_0;
+
+  slot.obuf = malloc(slot.obuf_size);
+  if (slot.obuf == NULL) goto on_error_1;
+
+  *osize = 0;
+
+  for (i = 0; i != sample_count; ++i)
+  {
+    slot.idata = buf + i * sample_size;
+    slot.isize = sample_size;
+    slot.dict_size = 0;
+    slot.err = -1;
+    codec->compress(&slot);
+    if (slot.err) goto on_error_2;
+    *osize += (uint64_t)slot.osize;
+  }
+
+  err = 0;
+
+ on_error_2:
+  free(slot.obuf);
+ on_error_1:
+  codec->fini(&slot);
+ on_error_0:
+  return err;
+}
+
+static int select_codec
+(
+ efpak_ostream_t* os, const data_src_t* src, uint64_t size,
+ const codec_t** codecp, int* levelp
+)
+{
+  /* select the codec and level used for block data of the given */
+  /* size, codecp set to NULL if not compressed */
+
+  const comp_choice_t ratio_choice = { os->comp, os->level };
+  const comp_choice_t* choices = comp_choices;
+  size_t count = sizeof(comp_choices) / sizeof(comp_choices[0]);
+  const codec_t* codec;
+  uint64_t max_size;
+  uint64_t osize;
+  uint8_t* buf;
+  size_t i;
+  int err = -1;
+
+  *codecp = NULL;
+  *levelp = 0;
+
+  /* compress file larger than inflate_oblock_size */
+  if (size <= (uint64_t)inflate_oblock_size) return 0;
+
+  if (os->policy == EFPAK_COMP_POLICY_FIXED)
+  {
+    *codecp = get_codec(os->comp);
+    *levelp = os->level;
+    return (*codecp == NULL) ? -1 : 0;
+  }
+
+  if (os->policy == EFPAK_COMP_POLICY_RATIO)
+  {
+    choices = &ratio_choice;
+    count = 1;
+  }
+
+  buf = malloc(sample_count * sample_size);
+  if (buf == NULL) goto on_error_0;
+
+  if (read_samples(src, size, buf)) goto on_error_1;
+
+  /* larger estimations are not worth decoding */
+  max_size = (uint64_t)(sample_count * sample_size) * os->max_ratio / 100;
+
+  for (i = 0; i != count; ++i)
+  {
+    codec = get_codec(choices[i].comp);
+    if (codec == NULL) continue ;
+
+    if (sample_codec(codec, choices[i].level, buf, &osize))
+      goto on_error_1;
+
+    if (osize > max_size) continue ;
+
+    *codecp = codec;
+    *levelp = choices[i].level;
+
+    /* the first acceptable choice is the fastest to decode */
+    if (os->policy != EFPAK_COMP_POLICY_SIZE) break ;
+    max_size = osize;
+  }
+
+  err = 0;
+
+ on_error_1:
+  free(buf);
+ on_error_0:
+  return err;
+}
+
+static int add_block_with_fd
+(efpak_ostream_t* os, const efpak_header_t* h, int fd)
+{
+  /* stream the file contents as the block data. the header is */
+  /* written first and patched once the data sizes are known. */
+  /* on error, the package is truncated to its previous size. */
+
+  struct stat st;
+  efpak_header_t* xh;
+  efpak_index_ext_t* index;
+  efpak_sparse_ext_t* sparse = NULL;
+  data_src_t src;
+  off64_t off;
+  uint64_t comp_size;
+  uint64_t raw_size;
+  uint64_t data_size;
+  const codec_t* codec;
+  int level;
+  int err = -1;
+
+  if (fstat(fd, &st)) goto on_error_1;
+
+  src.fd = fd;
+  src.sparse = NULL;
+  src.off = 0;
+  data_size = (uint64_t)st.st_size;
+
+  if ((os->flags & EFPAK_OSTREAM_FLAG_USED) && (h->type == EFPAK_BTYPE_PART))
+  {
+    const efpak_fsid_t fs_id = (efpak_fsid_t)h->u.part.fs_id;
+    if (scan_fs(fd, (uint64_t)st.st_size, fs_id, &sparse)) goto on_error_1;
+  }
+
+  /* only disk images are expected to contain large zero runs */
+  if ((sparse == NULL) && (os->flags & EFPAK_OSTREAM_FLAG_SPARSE) &&
+      ((h->type == EFPAK_BTYPE_DISK) || (h->type == EFPAK_BTYPE_PART)))
+  {
+    sparse = scan_sparse(fd, (uint64_t)st.st_size);
+    if (sparse == NULL) goto on_error_1;
+  }
+
+  if (sparse != NULL)
+  {
+    src.sparse = sparse;
+    data_size = get_sparse_data_size(sparse);
+  }
+
+  if (select_codec(os, &src, data_size, &codec, &level))
+    goto on_error_2;
+
+  xh = make_ext_header(os, h, codec, level, data_size, sparse);
+  if (xh == NULL) goto on_error_2;
+
+  index = (efpak_index_ext_t*)efpak_header_find_ext(xh, EFPAK_EXT_INDEX);
+
+  xh->comp_data_size = 0;
+  xh->raw_data_size = 0;
+
+  off = lseek64(os->fd, 0, SEEK_CUR);
+  if (off == (off64_t)-1) goto on_error_3;
+
+  if (add_block(os, xh, NULL)) goto on_error_4;
+
+  if (codec != NULL)
+  {
+    if (comp_data(os, &src, codec, level, index, &raw_size, &comp_size))
+      goto on_error_4;
+  }
+  else
+  {
+    if (copy_data(os->fd, &src, &raw_size)) goto on_error_4;
+    comp_size = raw_size;
+  }
+
+  /* the file changed since scanned */
+  if ((sparse != NULL) && (raw_size != data_size)) goto on_error_4;
+
+  xh->comp_data_size = comp_size;
+  xh->raw_data_size = raw_size;
+
+  if (pwrite64(os->fd, xh, xh->header_size, off) != (ssize_t)xh->header_size)
+    goto on_error_4;
+
+  err = 0;
+  goto on_error_3;
+
+ on_error_4:
+  if (ftruncate64(os->fd, off) == 0) lseek64(os->fd, off, SEEK_SET);
+ on_error_3:
+  free(xh);
+ on_error_2:
+  free(sparse);
+ on_error_1:
+  return err;
+}
+
+static int add_block_with_file
+(efpak_ostream_t* os, const efpak_header_t* h, const char* path)
+{
+  int fd;
+  int err;
+
+  fd = open(path, O_RDONLY | O_LARGEFILE);
+  if (fd == -1) return -1;
+
+  err = add_block_with_fd(os, h, fd);
+  close(fd);
+
+  return err;
+}
+
+/* delta encoding. source blocks are indexed by a rolling hash, and */
+/* looked up at every new contents offset, as in rsync. a match is */
+/* continued, exactly or approximately as in bsdiff, until the data */
+/* differs too much. the rest is stored as is. */
+
+static const size_t delta_block_size = 4096;
+
+typedef struct delta_entry
+{
+  uint32_t hash;
+  /* source block index plus 1, 0 if the entry is free */
+  uint32_t block;
+} delta_entry_t;
+
+typedef struct delta_enc
+{
+  const uint8_t* src;
+  size_t src_size;
+  const uint8_t* dst;
+
+  delta_entry_t* entries;
+  size_t mask;
+
+  /* output file and buffer */
+  int fd;
+  uint8_t* buf;
+  size_t buf_pos;
+
+  /* pending operation, merged with the next contiguous one */
+  uint8_t op;
+  size_t src_off;
+  size_t dst_off;
+  size_t size;
+
+  int err;
+
+} delta_enc_t;
+
+#define DELTA_OP_NONE 0xff
+
+static uint32_t delta_hash(uint32_t a, uint32_t b)
+{
+  return (a & 0xffff) | (b << 16);
+}
+
+static void delta_hash_init
+(const uint8_t* p, uint32_t* a, uint32_t* b)
+{
+  size_t i;
+
+  *a = 0;
+  *b = 0;
+
+  for (i = 0; i != delta_block_size; ++i)
+  {
+    *a += p[i];
+    *b += (uint32_t)(delta_block_size - i) * p[i];
+  }
+}
+
+static void delta_hash_roll
+(uint32_t* a, uint32_t* b, uint8_t out, uint8_t in)
+{
+  *a = *a - out + in;
+  *b = *b - (uint32_t)delta_block_size * out + *a;
+}
+
+static size_t delta_slot(const delta_enc_t* enc, uint32_t hash)
+{
+  return (size_t)((hash * 0x9e3779b97f4a7c15ULL) >> 32) & enc->mask;
+}
+
+static int delta_index_init(delta_enc_t* enc)
+{
+  const size_t count = enc->src_size / delta_block_size;
+  delta_entry_t* e;
+  uint32_t a;
+  uint32_t b;
+  uint32_t hash;
+  size_t n;
+  size_t i;
+
+  if (count >= (size_t)UINT32_MAX) return -1;
+
+  /* at most half full */
+  for (n = 1; n < (2 * count); n *= 2) ;
+
+  enc->entries = calloc(n, sizeof(delta_entry_t));
+  if (enc->entries == NULL) return -1;
+  enc->mask = n - 1;
+
+  for (i = 0; i != count; ++i)
+  {
+    delta_hash_init(enc->src + i * delta_block_size, &a, &b);
+    hash = delta_hash(a, b);
+
+    /* keep only the first block of a given hash */
+    e = &enc->entries[delta_slot(enc, hash)];
+    while (e->block && (e->hash != hash))
+    {
+      if (e == &enc->entries[enc->mask]) e = enc->entries;
+      else ++e;
+    }
+
+    if (e->block) continue ;
+
+    e->hash = hash;
+    e->block = (uint32_t)(i + 1);
+  }
+
+  return 0;
+}
+
+static size_t delta_index_find
+(const delta_enc_t* enc, uint32_t hash, const uint8_t* p)
+{
+  /* return the source offset of a block equal to p, or -1 */
+
+  const delta_entry_t* e = &enc->entries[delta_slot(enc, hash)];
+  size_t off;
+
+  for (; e->block; )
+  {
+    if (e->hash == hash)
+    {
+      off = (size_t)(e->block - 1) * delta_block_size;
+      if (memcmp(enc->src + off, p, delta_block_size) == 0) return off;
+      break ;
+    }
+
+    if (e == &enc->entries[enc->mask]) e = enc->entries;
+    else ++e;
+  }
+
+  return (size_t)-1;
+}
+
+static unsigned int delta_is_near
+(const uint8_t* a, const uint8_t* b, size_t size)
+{
+  /* worth an add operation, the differences compressing well */
+
+  size_t n = 0;
+  size_t i;
+
+  for (i = 0; i != size; ++i) n += (a[i] != b[i]);
+
+  return n <= (size / 8);
+}
+
+static int delta_write(delta_enc_t* enc, const uint8_t* p, size_t size)
+{
+  size_t n;
+
+  while (size)
+  {
+    if (enc->buf_pos == deflate_window_size)
+    {
+      if (write_buf(enc->fd, enc->buf, enc->buf_pos)) return -1;
+      enc->buf_pos = 0;
+    }
+
+    n = deflate_window_size - enc->buf_pos;
+    if (n > size) n = size;
+
+    /* NULL p for add payloads, computed in place */
+    if (p != NULL) memcpy(enc->buf + enc->buf_pos, p, n);
+    else
+    {
+      const uint8_t* const src = enc->src + enc->src_off;
+      const uint8_t* const dst = enc->dst + enc->dst_off;
+      uint8_t* const q = enc->buf + enc->buf_pos;
+      size_t i;
+      for (i = 0; i != n; ++i) q[i] = (uint8_t)(dst[i] - src[i]);
+      enc->src_off += n;
+      enc->dst_off += n;
+    }
+
+    enc->buf_pos += n;
+    if (p != NULL) p += n;
+    size -= n;
+  }
+
+  return 0;
+}
+
+static int delta_flush(delta_enc_t* enc)
+{
+  efpak_delta_op_t op;
+
+  if (enc->op == DELTA_OP_NONE) return 0;
+
+  op.op = enc->op;
+  op.src_off = (uint64_t)enc->src_off;
+  op.size = (uint64_t)enc->size;
+  if (delta_write(enc, (const uint8_t*)&op, sizeof(op))) return -1;
+
+  if (enc->op == EFPAK_DELTA_OP_DATA)
+  {
+    if (delta_write(enc, enc->dst + enc->dst_off, enc->size)) return -1;
+  }
+  else if (enc->op == EFPAK_DELTA_OP_ADD)
+  {
+    if (delta_write(enc, NULL, enc->size)) return -1;
+  }
+
+  enc->op = DELTA_OP_NONE;
+
+  return 0;
+}
+
+static int delta_emit
+(delta_enc_t* enc, uint8_t op, size_t src_off, size_t dst_off, size_t size)
+{
+  /* operations are contiguous in dst */
+
+  if ((enc->op == op) &&
+      ((op == EFPAK_DELTA_OP_DATA) || ((enc->src_off + enc->size) == src_off)))
+  {
+    enc->size += size;
+    return 0;
+  }
+
+  if (delta_flush(enc)) return -1;
+
+  enc->op = op;
+  enc->src_off = src_off;
+  enc->dst_off = dst_off;
+  enc->size = size;
+
+  return 0;
+}
+
+static int delta_encode_range(delta_enc_t* enc, size_t t, size_t end)
+{
+  const uint8_t* const dst = enc->dst;
+  const uint8_t* const src = enc->src;
+  const size_t bsize = delta_block_size;
+  unsigned int has_hash = 0;
+  size_t cur = (size_t)-1;
+  size_t lit = t;
+  size_t off;
+  size_t n;
+  uint32_t a = 0;
+  uint32_t b = 0;
+  uint8_t op;
+
+  while (t != end)
+  {
+    n = end - t;
+    if (n > bsize) n = bsize;
+    op = DELTA_OP_NONE;
+
+    /* continue the current match */
+    if ((cur != (size_t)-1) && (n <= (enc->src_size - cur)))
+    {
+      if (memcmp(dst + t, src + cur, n) == 0) op = EFPAK_DELTA_OP_COPY;
+      else if (delta_is_near(dst + t, src + cur, n)) op = EFPAK_DELTA_OP_ADD;
+    }
+
+    /* or find a new one */
+    if ((op != EFPAK_DELTA_OP_COPY) && (n == bsize))
+    {
+      if (has_hash == 0) delta_hash_init(dst + t, &a, &b);
+      has_hash = 1;
+
+      off = delta_index_find(enc, delta_hash(a, b), dst + t);
+      if (off != (size_t)-1)
+      {
+	cur = off;
+	op = EFPAK_DELTA_OP_COPY;
+      }
+    }
+
+    if (op == DELTA_OP_NONE)
+    {
+      /* no match, store the byte as is */
+      cur = (size_t)-1;
+      if (has_hash && ((t + bsize) < end))
+	delta_hash_roll(&a, &b, dst[t], dst[t + bsize]);
+      else
+	has_hash = 0;
+      ++t;
+      continue ;
+    }
+
+    if (lit != t)
+    {
+      if (delta_emit(enc, EFPAK_DELTA_OP_DATA, 0, lit, t - lit)) return -1;
+    }
+
+    if (delta_emit(enc, op, cur, t, n)) return -1;
+
+    t += n;
+    cur += n;
+    lit = t;
+    has_hash = 0;
+  }
+
+  if (lit != t)
+  {
+    if (delta_emit(enc, EFPAK_DELTA_OP_DATA, 0, lit, t - lit)) return -1;
+  }
+
+  return 0;
+}
+
+static int open_tmp_file(void)
+{
+  /* return an anonymous temporary file */
+
+  const char* dir = getenv("TMPDIR");
+  char path[256];
+  int fd;
+
+  if (dir == NULL) dir = "/tmp";
+  if ((strlen(dir) + sizeof("/efpak.XXXXXX")) > sizeof(path)) return -1;
+  strcpy(path, dir);
+  strcat(path, "/efpak.XXXXXX");
+
+  fd = mkstemp(path);
+  if (fd != -1) unlink(path);
+
+  return fd;
+}
+
+static int delta_encode_segment(delta_enc_t* enc, size_t t, size_t end)
+{
+  int err = -1;
+
+  enc->buf_pos = 0;
+  enc->op = DELTA_OP_NONE;
+
+  enc->buf = malloc(deflate_window_size);
+  if (enc->buf == NULL) goto on_error_0;
+
+  if (delta_encode_range(enc, t, end)) goto on_error_1;
+  if (delta_flush(enc)) goto on_error_1;
+  if (write_buf(enc->fd, enc->buf, enc->buf_pos)) goto on_error_1;
+
+  err = 0;
+
+ on_error_1:
+  free(enc->buf);
+ on_error_0:
+  return err;
+}
+
+/* large contents are split in segments encoded in parallel, each */
+/* one to its own temporary file. matches do not cross segments. */
+
+static const size_t delta_segment_size = 64 * 1024 * 1024;
+
+typedef struct delta_job
+{
+  const delta_enc_t* base;
+  delta_enc_t* encs;
+  size_t dst_size;
+} delta_job_t;
+
+static void delta_job_fn(void* arg, size_t i)
+{
+  delta_job_t* const job = arg;
+  delta_enc_t* const enc = &job->encs[i];
+  const size_t t = i * delta_segment_size;
+  size_t end;
+
+  end = job->dst_size - t;
+  if (end > delta_segment_size) end = delta_segment_size;
+  end += t;
+
+  *enc = *job->base;
+  enc->err = -1;
+
+  enc->fd = open_tmp_file();
+  if (enc->fd == -1) return ;
+
+  enc->err = delta_encode_segment(enc, t, end);
+}
+
+static int append_file(int ofd, int ifd, uint8_t* buf)
+{
+  /* append the whole ifd contents to ofd */
+
+  ssize_t n;
+
+  if (lseek64(ifd, 0, SEEK_SET) != 0) return -1;
+
+  while (1)
+  {
+    n = read(ifd, buf, deflate_window_size);
+    if (n < 0) return -1;
+    if (n == 0) break ;
+    if (write_buf(ofd, buf, (size_t)n)) return -1;
+  }
+
+  return 0;
+}
+
+static int delta_encode
+(
+ efpak_pool_t* pool,
+ const uint8_t* src, size_t src_size,
+ const uint8_t* dst, size_t dst_size,
+ int fd
+)
+{
+  /* write the operations building dst from src to fd */
+
+  delta_enc_t enc;
+  delta_enc_t* encs;
+  delta_job_t job;
+  uint8_t* buf;
+  size_t n;
+  size_t i;
+  int err = -1;
+
+  enc.src = src;
+  enc.src_size = src_size;
+  enc.dst = dst;
+  enc.fd = fd;
+
+  if (delta_index_init(&enc)) goto on_error_0;
+
+  n = dst_size / delta_segment_size;
+  if (dst_size % delta_segment_size) ++n;
+
+  if ((pool == NULL) || (n <= 1))
+  {
+    err = delta_encode_segment(&enc, 0, dst_size);
+    goto on_error_1;
+  }
+
+  encs = malloc(n * sizeof(delta_enc_t));
+  if (encs == NULL) goto on_error_1;
+
+  job.base = &enc;
+  job.encs = encs;
+  job.dst_size = dst_size;
+  pool_run(pool, delta_job_fn, &job, n);
+
+  /* concatenate the segment operations */
+  buf = malloc(deflate_window_size);
+  err = (buf == NULL) ? -1 : 0;
+
+  for (i = 0; i != n; ++i)
+  {
+    if (encs[i].err) err = -1;
+    else if ((err == 0) && append_file(fd, encs[i].fd, buf)) err = -1;
+    if (encs[i].fd != -1) close(encs[i].fd);
+  }
+
+  free(buf);
+  free(encs);
+ on_error_1:
+  free(enc.entries);
+ on_error_0:
+  return err;
+}
+
+static uLong crc32_large(const uint8_t* p, size_t size)
+{
+  /* crc32 takes a uInt size */
+
+  uLong crc = crc32(0, Z_NULL, 0);
+  size_t n;
+
+  for (; size; size -= n, p += n)
+  {
+    n = size;
+    if (n > (1 << 30)) n = 1 << 30;
+    crc = crc32(crc, p, (uInt)n);
+  }
+
+  return crc;
+}
+
+static int add_delta_with_fd
+(
+ efpak_ostream_t* os, int src_fd, int dst_fd,
+ efpak_partid_t part_id, efpak_fsid_t fs_id
+)
+{
+  efpak_header_t h;
+  const uint8_t* src;
+  const uint8_t* dst;
+  size_t src_size;
+  size_t dst_size;
+  int fd;
+  int err = -1;
+
+  if (map_fd(src_fd, &src, &src_size)) goto on_error_0;
+  if (map_fd(dst_fd, &dst, &dst_size)) goto on_error_1;
+
+  fd = open_tmp_file();
+  if (fd == -1) goto on_error_2;
+
+  if (delta_encode(os->pool, src, src_size, dst, dst_size, fd))
+    goto on_error_3;
+
+  init_header(&h);
+
+  h.type = EFPAK_BTYPE_DELTA;
+  h.header_size = header_min_size + sizeof(efpak_delta_header_t);
+
+  h.u.delta.part.part_id = part_id;
+  h.u.delta.part.fs_id = fs_id;
+  h.u.delta.src_size = (uint64_t)src_size;
+  h.u.delta.src_crc = (uint32_t)crc32_large(src, src_size);
+  h.u.delta.dst_size = (uint64_t)dst_size;
+
+  if (add_block_with_fd(os, &h, fd)) goto on_error_3;
+
+  err = 0;
+
+ on_error_3:
+  close(fd);
+ on_error_2:
+  unmap_file(dst, dst_size);
+ on_error_1:
+  unmap_file(src, src_size);
+ on_error_0:
+  return err;
+}
+
+
+/* package delta. blocks of the new package are matched against */
+/* the old package ones by type, and partition or file path. */
+
+static unsigned int is_same_block
+(const efpak_header_t* a, const efpak_header_t* b)
+{
+  if (a->type != b->type) return 0;
+
+  switch ((efpak_btype_t)a->type)
+  {
+  case EFPAK_BTYPE_PART:
+    return a->u.part.part_id == b->u.part.part_id;
+
+  case EFPAK_BTYPE_FILE:
+    if (a->u.file.path_len != b->u.file.path_len) return 0;
+    return memcmp(a->u.file.path, b->u.file.path, a->u.file.path_len) == 0;
+
+  default: break ;
+  }
+
+  return 0;
+}
+
+static const size_t copy_block_size = 1024 * 1024;
+
+static int copy_block(int fd, efpak_istream_t* is)
+{
+  /* write the current block as is, even partly read. windowed */
+  /* block data are copied from the package file, by the kernel */
+  /* if possible, as the header is the only one held in memory. */
+
+  /* ASSUME: is->is_in_block == 0 */
+
+  const efpak_header_t* const h = is->header;
+  uint8_t* buf = NULL;
+  uint64_t size;
+  uint64_t off;
+  size_t n;
   int err = -1;
 
-  /* ASSUME: is->is_in_block == 0 */
+  if (is->fd == -1)
+    return write_buf(fd, (const uint8_t*)h, get_block_size(h));
 
-  /* TODO: check sum overflow */
+  /* streamed data already read are lost */
+  if (is->win_size == 0) goto on_error;
 
-  if ((is->off + h->header_size + h->comp_data_size) > is->size)
+  if (write_buf(fd, (const uint8_t*)h, (size_t)h->header_size))
     goto on_error;
 
-  data = is->data + is->off + h->header_size;
-  size = h->comp_data_size;
+  off = get_fd_data_off(is);
 
-  switch ((efpak_bcomp_t)is->header->comp)
+  for (size = h->comp_data_size; size; size -= (uint64_t)n)
   {
-  case EFPAK_BCOMP_NONE:
-    {
-      err = ram_mem_init(&is->mem, data, size);
-      break ;
-    }
+    n = copy_block_size;
+    if ((uint64_t)n > size) n = (size_t)size;
 
-  case EFPAK_BCOMP_ZLIB:
+    if (buf == NULL)
     {
-      err = inflate_mem_init(&is->mem, data, size);
-      break ;
+      n = copy_fd(is->fd, &off, fd, n);
+      if (n == (size_t)-1) goto on_error;
+      if (n) continue ;
+
+      buf = malloc(copy_block_size);
+      if (buf == NULL) goto on_error;
+      n = copy_block_size;
+      if ((uint64_t)n > size) n = (size_t)size;
     }
 
-  default:
-    {
-      PERROR();
-      goto on_error;
-      break ;
-    }
+    if (pread_full(is->fd, buf, n, off) != n) goto on_error;
+    if (write_buf(fd, buf, n)) goto on_error;
+    off += (uint64_t)n;
   }
 
-  if (err == 0) is->is_in_block = 1;
+  err = 0;
 
  on_error:
+  free(buf);
   return err;
 }
 
-void efpak_istream_end_block
-(efpak_istream_t* is)
+static const efpak_header_t* find_old_block
+(const efpak_istream_t* is, const efpak_header_t* h)
 {
-  /* ASSUME: is->is_in_block == 1 */
+  /* return the is block matching h, or NULL */
 
-  is->mem.fini(&is->mem);
-  is->is_in_block = 0;
-}
+  const efpak_header_t* x;
+  size_t off;
 
-int efpak_istream_seek
-(efpak_istream_t* is, size_t off)
-{
-  /* ASSUME: is->is_in_block == 1 */
+  for (off = 0; off != is->size; off += get_block_size(x))
+  {
+    x = (const efpak_header_t*)(is->data + off);
+    if ((off + x->header_size) > is->size) break ;
+    if ((off + get_block_size(x)) > is->size) break ;
+    if (is_same_block(x, h)) return x;
+  }
 
-  return is->mem.seek(&is->mem, off);
+  return NULL;
 }
 
-int efpak_istream_next
-(efpak_istream_t* is, const uint8_t** data, size_t* size)
+static int compare_blocks
+(efpak_istream_t* a, efpak_istream_t* b, unsigned int* is_equal)
 {
-  /* ASSUME: is->is_in_block == 1 */
-
-  return is->mem.next(&is->mem, data, size);
-}
-
+  /* compare the started block contents */
 
-/* output stream exported routines */
+  const uint8_t* pa;
+  const uint8_t* pb;
+  size_t na;
+  size_t nb;
 
-static int deflateInit2Default(z_stream* z)
-{
-  return deflateInit2
-    (z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
-     16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
-}
+  *is_equal = 0;
 
-static int deflate_mem
-(const uint8_t* idata, size_t isize, const uint8_t** odata, size_t* osize)
-{
-  uLong dlen;
-  z_stream z;
-  int err = -1;
+  if (efpak_header_get_size(a->header) != efpak_header_get_size(b->header))
+    return 0;
 
-  dlen = compressBound((uLong)isize);
+  while (1)
+  {
+    na = (size_t)-1;
+    if (efpak_istream_next(a, &pa, &na)) return -1;
+    if (na == 0) break ;
 
-  *odata = malloc((size_t)dlen);
-  if (*odata == NULL) goto on_error_0;
+    for (; na; na -= nb, pa += nb)
+    {
+      nb = na;
+      if (efpak_istream_next(b, &pb, &nb)) return -1;
+      if (nb == 0) return 0;
+      if (memcmp(pa, pb, nb)) return 0;
+    }
+  }
 
-  z.next_in = (Bytef*)idata;
-  z.avail_in = (uInt)isize;
+  *is_equal = 1;
 
-  z.next_out = (Bytef*)*odata;
-  z.avail_out = (uInt)dlen;
+  return 0;
+}
 
-  z.zalloc = Z_NULL;
-  z.zfree = Z_NULL;
-  z.opaque = Z_NULL;
+static int pkg_delta_file
+(
+ efpak_ostream_t* os,
+ efpak_istream_t* old_is, const efpak_header_t* old_h,
+ efpak_istream_t* new_is
+)
+{
+  /* unchanged files are dropped */
 
-  if (deflateInit2Default(&z) != Z_OK) goto on_error_1;
-  if (deflate(&z, Z_SYNC_FLUSH) != Z_OK) goto on_error_2;
-  if (z.avail_in) goto on_error_2;
+  unsigned int is_equal = 0;
+  int err = -1;
 
-  *osize = (size_t)dlen - (size_t)z.avail_out;
+  if (start_block_at(old_is, old_h)) goto on_error_0;
+  if (efpak_istream_start_block(new_is)) goto on_error_1;
+  if (compare_blocks(old_is, new_is, &is_equal)) goto on_error_2;
   err = 0;
 
  on_error_2:
-  deflateEnd(&z);
+  efpak_istream_end_block(new_is);
  on_error_1:
-  if (err) free((void*)*odata);
+  efpak_istream_end_block(old_is);
  on_error_0:
+  if ((err == 0) && (is_equal == 0)) err = copy_block(os->fd, new_is);
   return err;
 }
 
-static int deflate_file_if_large
-(
- const char* path,
- const uint8_t** odata, size_t* isize, size_t* osize,
- unsigned int* is_deflated
-)
+static int decode_block(efpak_istream_t* is, int fd)
 {
-  const uint8_t* idata;
+  /* write the started block contents to fd, leaving holes. the */
+  /* whole contents must be decoded. */
 
-  if (map_file(path, &idata, isize)) return -1;
+  unsigned int is_hole = 0;
+  uint64_t total = 0;
+  const uint8_t* p;
+  size_t n;
 
-  /* compress file larger than inflate_oblock_size */
-  if (*isize > inflate_oblock_size)
-  {
-    const int err = deflate_mem(idata, *isize, odata, osize);
-    unmap_file(idata, *isize);
-    if (err) return -1;
-    *is_deflated = 1;
-  }
-  else
+  while (1)
   {
-    *odata = idata;
-    *osize = *isize;
-    *is_deflated = 0;
+    n = (size_t)-1;
+    if (efpak_istream_next_zero(is, &n)) return -1;
+
+    if (n)
+    {
+      if (lseek64(fd, (off64_t)n, SEEK_CUR) == (off64_t)-1) return -1;
+      total += (uint64_t)n;
+      is_hole = 1;
+      continue ;
+    }
+
+    n = (size_t)-1;
+    if (efpak_istream_next(is, &p, &n)) return -1;
+    if (n == 0) break ;
+    if (write_buf(fd, p, n)) return -1;
+    total += (uint64_t)n;
+    is_hole = 0;
   }
 
-  return 0;
+  if (total != efpak_header_get_size(is->header)) return -1;
+
+  /* extend the file if it ends with a hole */
+  if (is_hole == 0) return 0;
+  return ftruncate64(fd, (off64_t)total);
 }
 
-static void init_header
-(efpak_header_t* h)
+static int decode_block_at
+(efpak_istream_t* is, const efpak_header_t* h, int* fd)
 {
-  h->vers = 0;
+  /* decode to a temporary file */
+
+  int err = -1;
+
+  *fd = open_tmp_file();
+  if (*fd == -1) goto on_error_0;
+
+  if (start_block_at(is, h)) goto on_error_1;
+  err = decode_block(is, *fd);
+  efpak_istream_end_block(is);
+  if (err) goto on_error_1;
+
+  return 0;
+
+ on_error_1:
+  close(*fd);
+ on_error_0:
+  return -1;
 }
 
-static int add_block
-(efpak_ostream_t* os, const efpak_header_t* header, const uint8_t* data)
+static int pkg_delta_part
+(
+ efpak_ostream_t* os,
+ efpak_istream_t* old_is, const efpak_header_t* old_h,
+ efpak_istream_t* new_is
+)
 {
-  ssize_t res;
+  /* unchanged partitions are dropped, other ones made deltas */
+
+  const efpak_header_t* const h = new_is->header;
+  const efpak_sparse_ext_t* sparse;
+  const uint8_t* old_data;
+  const uint8_t* new_data;
+  size_t old_size;
+  size_t new_size;
+  unsigned int is_equal;
+  int old_fd;
+  int new_fd;
+  int err = -1;
 
-  /* TODO: convert header fields if local endianness is not little */
-#if (__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__)
-#error "unsupported endianness"
-#endif
+  /* the unused blocks of the installed partition are unknown */
+  sparse = get_sparse_ext(old_h);
+  if ((sparse != NULL) && (sparse->flags & EFPAK_SPARSE_FLAG_UNUSED))
+    return copy_block(os->fd, new_is);
 
-  res = write(os->fd, (const uint8_t*)header, header->header_size);
-  if (res != (ssize_t)header->header_size) return -1;
+  if (decode_block_at(old_is, old_h, &old_fd)) goto on_error_0;
+  if (decode_block_at(new_is, h, &new_fd)) goto on_error_1;
 
-  if (data != NULL)
+  if (map_fd(old_fd, &old_data, &old_size)) goto on_error_2;
+  if (map_fd(new_fd, &new_data, &new_size)) goto on_error_3;
+
+  is_equal = 0;
+  if (old_size == new_size)
+    is_equal = (memcmp(old_data, new_data, old_size) == 0);
+
+  unmap_file(new_data, new_size);
+
+  err = 0;
+  if (is_equal == 0)
   {
-    res = write(os->fd, data, header->comp_data_size);
-    if (res != (ssize_t)header->comp_data_size) return -1;
+    err = add_delta_with_fd
+      (os, old_fd, new_fd, h->u.part.part_id, h->u.part.fs_id);
   }
 
-  return 0;
+ on_error_3:
+  unmap_file(old_data, old_size);
+ on_error_2:
+  close(new_fd);
+ on_error_1:
+  close(old_fd);
+ on_error_0:
+  return err;
 }
 
-static const size_t header_min_size = offsetof(efpak_header_t, u.per_type);
-
 static int efpak_ostream_add_format
 (efpak_ostream_t* os)
 {
@@ -628,20 +6137,149 @@ static int efpak_ostream_add_format
   return add_block(os, &h, NULL);
 }
 
+static int drop_toc(efpak_ostream_t* os, off64_t off)
+{
+  /* remove the table of contents ending the package, if any */
+
+  efpak_toc_trailer_t t;
+  efpak_header_t h;
+  size_t size;
+
+  size = sizeof(efpak_toc_trailer_t);
+  if ((uint64_t)off < (uint64_t)size) return 0;
+  if (pread_full(os->fd, (uint8_t*)&t, size, off - size) != size) return -1;
+  if (t.magic != EFPAK_TOC_MAGIC) return 0;
+  if (t.off >= (uint64_t)off) return 0;
+
+  size = header_min_size;
+  if (pread_full(os->fd, (uint8_t*)&h, size, t.off) != size) return 0;
+  if (h.type != EFPAK_BTYPE_TOC) return 0;
+  if ((t.off + h.header_size + h.comp_data_size) != (uint64_t)off) return 0;
+
+  if (ftruncate64(os->fd, (off64_t)t.off)) return -1;
+  if (lseek64(os->fd, (off64_t)t.off, SEEK_SET) != (off64_t)t.off)
+    return -1;
+
+  return 0;
+}
+
+static int add_toc(efpak_ostream_t* os)
+{
+  /* walk the package headers and append the table of contents */
+
+  efpak_toc_entry_t* entries;
+  efpak_toc_entry_t* e;
+  efpak_toc_trailer_t t;
+  efpak_header_t* h;
+  efpak_header_t th;
+  size_t max_count = 256;
+  size_t count = 0;
+  size_t hsize;
+  uint64_t off;
+  off64_t end;
+  int err = -1;
+
+  end = lseek64(os->fd, 0, SEEK_END);
+  if (end == (off64_t)-1) goto on_error_0;
+
+  /* the largest header needed, for file paths */
+  hsize = offsetof(efpak_header_t, u.file.path) + UINT16_MAX;
+  h = malloc(hsize);
+  if (h == NULL) goto on_error_0;
+
+  entries = malloc(max_count * sizeof(efpak_toc_entry_t));
+  if (entries == NULL) goto on_error_1;
+
+  for (off = 0; off != (uint64_t)end; off += e->size)
+  {
+    if (pread_full(os->fd, (uint8_t*)h, header_min_size, off) !=
+	header_min_size)
+      goto on_error_2;
+
+    if (h->type == EFPAK_BTYPE_FILE)
+    {
+      hsize = offsetof(efpak_header_t, u.file.path);
+      if (pread_full(os->fd, (uint8_t*)h, hsize, off) != hsize)
+	goto on_error_2;
+      hsize += h->u.file.path_len;
+      if (pread_full(os->fd, (uint8_t*)h, hsize, off) != hsize)
+	goto on_error_2;
+    }
+
+    if (count == max_count)
+    {
+      max_count *= 2;
+      e = realloc(entries, max_count * sizeof(efpak_toc_entry_t));
+      if (e == NULL) goto on_error_2;
+      entries = e;
+    }
+
+    e = &entries[count++];
+    e->off = off;
+    e->size = h->header_size + h->comp_data_size;
+    e->type = h->type;
+    e->path_hash = get_file_hash(h);
+
+    if (e->size > ((uint64_t)end - off)) goto on_error_2;
+    if (e->size == 0) goto on_error_2;
+  }
+
+  init_header(&th);
+
+  th.type = EFPAK_BTYPE_TOC;
+  th.comp = EFPAK_BCOMP_NONE;
+  th.header_size = header_min_size + sizeof(efpak_toc_header_t);
+  th.comp_data_size = count * sizeof(efpak_toc_entry_t) + sizeof(t);
+  th.raw_data_size = th.comp_data_size;
+  th.u.toc.count = (uint32_t)count;
+
+  t.off = (uint64_t)end;
+  t.magic = EFPAK_TOC_MAGIC;
+
+  if (add_block(os, &th, NULL)) goto on_error_3;
+  if (write_buf(os->fd, (const uint8_t*)entries,
+		count * sizeof(efpak_toc_entry_t)))
+    goto on_error_3;
+  if (write_buf(os->fd, (const uint8_t*)&t, sizeof(t))) goto on_error_3;
+
+  err = 0;
+  goto on_error_2;
+
+ on_error_3:
+  if (ftruncate64(os->fd, end) == 0) lseek64(os->fd, end, SEEK_SET);
+ on_error_2:
+  free(entries);
+ on_error_1:
+  free(h);
+ on_error_0:
+  return err;
+}
+
 int efpak_ostream_init_with_file
 (efpak_ostream_t* os, const char* path)
 {
-  off_t off;
+  off64_t off;
+
+  os->flags = 0;
+  os->comp = EFPAK_BCOMP_ZLIB;
+  os->level = 0;
+  os->policy = EFPAK_COMP_POLICY_FIXED;
+  os->max_ratio = 90;
+  os->pool = NULL;
+  os->thread_count = 1;
 
-  os->fd = open(path, O_RDWR | O_CREAT, 0755);
+  os->fd = open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0755);
   if (os->fd == -1) goto on_error_0;
 
-  off = lseek(os->fd, 0, SEEK_END);
-  if (off == (off_t)-1) goto on_error_1;
+  off = lseek64(os->fd, 0, SEEK_END);
+  if (off == (off64_t)-1) goto on_error_1;
 
   /* add header in newly created file */
   if ((off == 0) && efpak_ostream_add_format(os)) goto on_error_1;
 
+  /* appended blocks would not be listed */
+  if (drop_toc(os, off)) goto on_error_1;
+
   return 0;
 
  on_error_1:
@@ -653,39 +6291,79 @@ int efpak_ostream_init_with_file
 void efpak_ostream_fini
 (efpak_ostream_t* os)
 {
+  if (os->flags & EFPAK_OSTREAM_FLAG_TOC) add_toc(os);
+  pool_destroy(os->pool);
   close(os->fd);
 }
 
+void efpak_ostream_set_flags
+(efpak_ostream_t* os, uint32_t flags)
+{
+  os->flags = flags;
+}
+
+int efpak_ostream_set_comp
+(efpak_ostream_t* os, efpak_bcomp_t comp, int level)
+{
+  /* level 0 selects the codec default level */
+
+  if (get_codec(comp) == NULL) return -1;
+
+  os->comp = comp;
+  os->level = level;
+
+  return 0;
+}
+
+int efpak_ostream_set_policy
+(efpak_ostream_t* os, efpak_comp_policy_t policy, unsigned int max_ratio)
+{
+  /* max_ratio is not used by the fixed policy */
+
+  if (policy >= EFPAK_COMP_POLICY_INVALID) return -1;
+  if ((max_ratio == 0) || (max_ratio > 100)) return -1;
+
+  os->policy = policy;
+  os->max_ratio = max_ratio;
+
+  return 0;
+}
+
+int efpak_ostream_set_thread_count
+(efpak_ostream_t* os, size_t n)
+{
+  /* n the count of threads used to compress, including caller */
+
+  efpak_pool_t* pool = NULL;
+
+  if (n == 0) return -1;
+
+  if (n > 1)
+  {
+    pool = pool_create(n);
+    if (pool == NULL) return -1;
+  }
+
+  pool_destroy(os->pool);
+  os->pool = pool;
+  os->thread_count = n;
+
+  return 0;
+}
+
 int efpak_ostream_add_disk
 (efpak_ostream_t* os, const char* path)
 {
   efpak_header_t h;
-  unsigned int is_comp;
-  const uint8_t* data;
-  size_t comp_size;
-  size_t raw_size;
-  int err = -1;
-
-  if (deflate_file_if_large(path, &data, &raw_size, &comp_size, &is_comp))
-    goto on_error_0;
 
   init_header(&h);
 
   h.type = EFPAK_BTYPE_DISK;
-  h.comp = is_comp ? EFPAK_BCOMP_ZLIB : EFPAK_BCOMP_NONE;
   h.header_size = header_min_size + sizeof(efpak_disk_header_t);
-  h.comp_data_size = comp_size;
-  h.raw_data_size = raw_size;
-
-  if (add_block(os, &h, data)) goto on_error_1;
 
-  err = 0;
+  h.u.disk.dummy = 0;
 
- on_error_1:
-  if (is_comp) free((void*)data);
-  else unmap_file(data, comp_size);
- on_error_0:
-  return err;
+  return add_block_with_file(os, &h, path);
 }
 
 int efpak_ostream_add_part
@@ -696,35 +6374,16 @@ int efpak_ostream_add_part
 )
 {
   efpak_header_t h;
-  unsigned int is_comp;
-  const uint8_t* data;
-  size_t comp_size;
-  size_t raw_size;
-  int err = -1;
-
-  if (deflate_file_if_large(path, &data, &raw_size, &comp_size, &is_comp))
-    goto on_error_0;
 
   init_header(&h);
 
   h.type = EFPAK_BTYPE_PART;
-  h.comp = is_comp ? EFPAK_BCOMP_ZLIB : EFPAK_BCOMP_NONE;
   h.header_size = header_min_size + sizeof(efpak_part_header_t);
-  h.comp_data_size = comp_size;
-  h.raw_data_size = raw_size;
 
   h.u.part.part_id = part_id;
   h.u.part.fs_id = fs_id;
 
-  if (add_block(os, &h, data)) goto on_error_1;
-
-  err = 0;
-
- on_error_1:
-  if (is_comp) free((void*)data);
-  else unmap_file(data, comp_size);
- on_error_0:
-  return err;
+  return add_block_with_file(os, &h, path);
 }
 
 int efpak_ostream_add_file
@@ -735,10 +6394,6 @@ int efpak_ostream_add_file
 
   efpak_header_t* h;
   size_t header_size;
-  unsigned int is_comp;
-  const uint8_t* data;
-  size_t comp_size;
-  size_t raw_size;
   size_t len;
   int err = -1;
 
@@ -747,27 +6402,18 @@ int efpak_ostream_add_file
   h = malloc(header_size);
   if (h == NULL) goto on_error_0;
 
-  if (deflate_file_if_large(lpath, &data, &raw_size, &comp_size, &is_comp))
-    goto on_error_1;
-
   init_header(h);
 
   h->type = EFPAK_BTYPE_FILE;
-  h->comp = is_comp ? EFPAK_BCOMP_ZLIB : EFPAK_BCOMP_NONE;
   h->header_size = header_size;
-  h->comp_data_size = comp_size;
-  h->raw_data_size = raw_size;
 
   h->u.file.path_len = len;
   strcpy((char*)h->u.file.path, dpath);
 
-  if (add_block(os, h, data)) goto on_error_2;
+  if (add_block_with_file(os, h, lpath)) goto on_error_1;
 
   err = 0;
 
- on_error_2:
-  if (is_comp) free((void*)data);
-  else unmap_file(data, comp_size);
  on_error_1:
   free(h);
  on_error_0:
@@ -786,10 +6432,6 @@ int efpak_ostream_add_hook
 
   efpak_header_t* h;
   size_t header_size;
-  unsigned int is_comp;
-  const uint8_t* data;
-  size_t comp_size;
-  size_t raw_size;
   size_t len;
   int err = -1;
 
@@ -799,31 +6441,118 @@ int efpak_ostream_add_hook
   h = malloc(header_size);
   if (h == NULL) goto on_error_0;
 
-  if (deflate_file_if_large(dpath, &data, &raw_size, &comp_size, &is_comp))
-    goto on_error_1;
-
   init_header(h);
 
   h->type = EFPAK_BTYPE_HOOK;
-  h->comp = is_comp ? EFPAK_BCOMP_ZLIB : EFPAK_BCOMP_NONE;
   h->header_size = header_size;
-  h->comp_data_size = comp_size;
-  h->raw_data_size = raw_size;
 
   h->u.hook.when_flags = when_flags;
   h->u.hook.exec_flags = exec_flags;
   h->u.hook.path_len = len;
   if (xpath != NULL) strcpy((char*)h->u.hook.path, xpath);
 
-  if (add_block(os, h, data)) goto on_error_2;
+  if (add_block_with_file(os, h, dpath)) goto on_error_1;
 
   err = 0;
 
- on_error_2:
-  if (is_comp) free((void*)data);
-  else unmap_file(data, comp_size);
  on_error_1:
   free(h);
  on_error_0:
   return err;
 }
+
+int efpak_ostream_add_delta
+(
+ efpak_ostream_t* os,
+ const char* src_path, const char* dst_path,
+ efpak_partid_t part_id, efpak_fsid_t fs_id
+)
+{
+  /* add a delta block reconstructing the dst_path partition image */
+  /* from the installed one, whose image is src_path */
+
+  int src_fd;
+  int dst_fd;
+  int err = -1;
+
+  src_fd = open(src_path, O_RDONLY | O_LARGEFILE);
+  if (src_fd == -1) goto on_error_0;
+
+  dst_fd = open(dst_path, O_RDONLY | O_LARGEFILE);
+  if (dst_fd == -1) goto on_error_1;
+
+  err = add_delta_with_fd(os, src_fd, dst_fd, part_id, fs_id);
+
+  close(dst_fd);
+ on_error_1:
+  close(src_fd);
+ on_error_0:
+  return err;
+}
+
+int efpak_ostream_add_efpak_delta
+(efpak_ostream_t* os, const char* old_path, const char* new_path)
+{
+  /* add the new_path package blocks, as needed to update a device */
+  /* where the old_path package is installed. file blocks found */
+  /* unchanged are dropped, partition blocks become delta blocks, */
+  /* and other blocks are copied as is. */
+
+  /* the old package blocks are looked up in its mapping, so that */
+  /* it must be mapped whole. the new one is walked, and may be */
+  /* mapped by windows. */
+
+  efpak_istream_t old_is;
+  efpak_istream_t new_is;
+  const efpak_header_t* old_h;
+  const efpak_header_t* h;
+  int err = -1;
+
+  if (efpak_istream_init_with_file(&old_is, old_path)) goto on_error_0;
+  if (old_is.fd != -1)
+  {
+    PERROR();
+    goto on_error_1;
+  }
+
+  if (efpak_istream_init_with_file(&new_is, new_path)) goto on_error_1;
+
+  if (efpak_istream_set_thread_count(&old_is, os->thread_count))
+    goto on_error_2;
+  if (efpak_istream_set_thread_count(&new_is, os->thread_count))
+    goto on_error_2;
+
+  while (1)
+  {
+    if (efpak_istream_next_block(&new_is, &h)) goto on_error_2;
+    if (h == NULL) break ;
+
+    /* the output package has its own format and toc blocks */
+    if (h->type == EFPAK_BTYPE_FORMAT) continue ;
+    if (h->type == EFPAK_BTYPE_TOC) continue ;
+
+    old_h = find_old_block(&old_is, h);
+
+    if ((old_h != NULL) && (h->type == EFPAK_BTYPE_FILE))
+    {
+      if (pkg_delta_file(os, &old_is, old_h, &new_is)) goto on_error_2;
+    }
+    else if ((old_h != NULL) && (h->type == EFPAK_BTYPE_PART))
+    {
+      if (pkg_delta_part(os, &old_is, old_h, &new_is)) goto on_error_2;
+    }
+    else
+    {
+      if (copy_block(os->fd, &new_is)) goto on_error_2;
+    }
+  }
+
+  err = 0;
+
+ on_error_2:
+  efpak_istream_fini(&new_is);
+ on_error_1:
+  efpak_istream_fini(&old_is);
+ on_error_0:
+  return err;
+}
@@ -4,6 +4,8 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "zlib.h"
 
 
@@ -18,6 +20,8 @@ typedef enum efpak_btype
   EFPAK_BTYPE_PART,
   EFPAK_BTYPE_FILE,
   EFPAK_BTYPE_HOOK,
+  EFPAK_BTYPE_DELTA,
+  EFPAK_BTYPE_TOC,
   EFPAK_BTYPE_INVALID
 } efpak_btype_t;
 
@@ -27,10 +31,28 @@ typedef enum efpak_bcomp
 {
   EFPAK_BCOMP_NONE = 0,
   EFPAK_BCOMP_ZLIB,
+  EFPAK_BCOMP_ZSTD,
+  EFPAK_BCOMP_LZ4,
+  EFPAK_BCOMP_XZ,
   EFPAK_BCOMP_INVALID
 } efpak_bcomp_t;
 
 
+/* block compression selection policy, at packaging time */
+typedef enum efpak_comp_policy
+{
+  /* the ostream codec for all large enough blocks */
+  EFPAK_COMP_POLICY_FIXED = 0,
+  /* the ostream codec if its estimated ratio is good enough */
+  EFPAK_COMP_POLICY_RATIO,
+  /* the codec giving the smallest estimated size */
+  EFPAK_COMP_POLICY_SIZE,
+  /* the fastest to decode codec with a good enough ratio */
+  EFPAK_COMP_POLICY_SPEED,
+  EFPAK_COMP_POLICY_INVALID
+} efpak_comp_policy_t;
+
+
 /* partition identifier */
 typedef enum efpak_partid
 {
@@ -130,6 +152,144 @@ typedef struct efpak_hook_header
 } __attribute__((packed)) efpak_hook_header_t;
 
 
+/* delta block header */
+/* the block data is a sequence of operations reconstructing a new */
+/* partition contents from the currently installed one, the source. */
+typedef struct efpak_delta_header
+{
+  /* the partition, as in a partition block header */
+  efpak_part_header_t part;
+
+  /* source size and crc32, checked before applying */
+  uint64_t src_size;
+  uint32_t src_crc;
+
+  /* reconstructed partition contents size */
+  uint64_t dst_size;
+} __attribute__((packed)) efpak_delta_header_t;
+
+
+/* delta operation */
+/* operations output the new contents sequentially. an operation */
+/* header is followed by size bytes for the add and data ones. */
+typedef struct efpak_delta_op
+{
+  /* size bytes from the source at src_off */
+#define EFPAK_DELTA_OP_COPY 0
+  /* size bytes from the source at src_off, each one added the */
+  /* corresponding following byte, modulo 256 */
+#define EFPAK_DELTA_OP_ADD 1
+  /* the following size bytes, src_off unused */
+#define EFPAK_DELTA_OP_DATA 2
+  uint8_t op;
+
+  uint64_t src_off;
+  uint64_t size;
+} __attribute__((packed)) efpak_delta_op_t;
+
+
+/* table of contents block header */
+/* the optional last block of a package. its data is an entry per */
+/* previous block, in order, followed by a trailer locating the */
+/* block from the end of the package. */
+typedef struct efpak_toc_header
+{
+  uint32_t count;
+} __attribute__((packed)) efpak_toc_header_t;
+
+typedef struct efpak_toc_entry
+{
+  /* block offset in the package and size, header included */
+  uint64_t off;
+  uint64_t size;
+  /* one of efpak_btype_t */
+  uint8_t type;
+  /* fnv1a hash of file block paths, without the 0, or 0 */
+  uint32_t path_hash;
+} __attribute__((packed)) efpak_toc_entry_t;
+
+typedef struct efpak_toc_trailer
+{
+  /* table of contents block offset in the package */
+  uint64_t off;
+#define EFPAK_TOC_MAGIC 0x636f7465
+  uint32_t magic;
+} __attribute__((packed)) efpak_toc_trailer_t;
+
+
+/* header extensions */
+/* extensions are optional records stored after the type specific */
+/* header, up to the block header_size. unknown ones are skipped. */
+typedef struct efpak_ext_header
+{
+  /* one of EFPAK_EXT_xxx */
+#define EFPAK_EXT_INDEX 0
+#define EFPAK_EXT_DICT 1
+#define EFPAK_EXT_SPARSE 2
+  uint16_t type;
+
+  /* extension size in bytes, this header included */
+  uint32_t size;
+} __attribute__((packed)) efpak_ext_header_t;
+
+
+/* chunk index extension */
+/* each entry is a restart point in the compressed data. decoding */
+/* can start at comp_off, without prior data, to produce raw data */
+/* from raw_off. entries are sorted by increasing offsets. */
+typedef struct efpak_index_entry
+{
+  /* offsets relative to the block data */
+  uint64_t comp_off;
+  uint64_t raw_off;
+} __attribute__((packed)) efpak_index_entry_t;
+
+typedef struct efpak_index_ext
+{
+  efpak_ext_header_t ext;
+  uint32_t count;
+  efpak_index_entry_t entries[1];
+} __attribute__((packed)) efpak_index_ext_t;
+
+
+/* decoder dictionary extension */
+/* the dictionary size the block decoder needs, in bytes. it bounds */
+/* the decoder memory usage, allowing to refuse a block up front. */
+typedef struct efpak_dict_ext
+{
+  efpak_ext_header_t ext;
+  uint32_t dict_size;
+} __attribute__((packed)) efpak_dict_ext_t;
+
+
+/* sparse extension */
+/* the block raw data only contains the listed extents of the block */
+/* contents, whose size is given by the extension. the rest are zero */
+/* runs, or unused filesystem blocks whose contents do not matter. */
+/* extents are sorted by increasing offsets and do not overlap. */
+typedef struct efpak_extent
+{
+  /* offset in block contents */
+  uint64_t off;
+  /* offset in block raw data */
+  uint64_t data_off;
+  uint64_t size;
+} __attribute__((packed)) efpak_extent_t;
+
+typedef struct efpak_sparse_ext
+{
+  efpak_ext_header_t ext;
+  /* block contents size */
+  uint64_t size;
+  /* holes are unused blocks, they read as zeroes but need not be */
+  /* written when installing */
+#define EFPAK_SPARSE_FLAG_UNUSED (1 << 0)
+  uint32_t flags;
+  uint32_t count;
+  efpak_extent_t extents[1];
+} __attribute__((packed)) efpak_sparse_ext_t;
+
+
 /* generic block header */
 typedef struct efpak_header
 {
@@ -158,27 +318,152 @@ typedef struct efpak_header
     efpak_part_header_t part;
     efpak_file_header_t file;
     efpak_hook_header_t hook;
+    efpak_delta_header_t delta;
+    efpak_toc_header_t toc;
     uint8_t per_type[1];
   } __attribute__((packed)) u;
 
 } __attribute__((packed)) efpak_header_t;
 
 
+/* worker thread pool */
+
+typedef struct efpak_pool
+{
+  pthread_mutex_t lock;
+  pthread_cond_t job_cond;
+  pthread_cond_t done_cond;
+
+  /* the calling thread is not included */
+  pthread_t* threads;
+  size_t thread_count;
+
+  /* current job batch */
+  void (*fn)(void*, size_t);
+  void* arg;
+  size_t job_count;
+  size_t job_next;
+  size_t job_done;
+
+  unsigned int is_stopping;
+
+} efpak_pool_t;
+
+
 /* input stream handling related types */
 
+/* zlib access point. the raw deflate stream restarts at a deflate */
+/* block boundary, from the window of the data preceding it. bits */
+/* is the count of bits of the previous input byte not consumed. */
+
+#define EFPAK_INFLATE_WINDOW_SIZE 32768
+
+typedef struct efpak_inflate_point
+{
+  uint64_t raw_off;
+  size_t comp_off;
+  int bits;
+  size_t window_size;
+  uint8_t window[EFPAK_INFLATE_WINDOW_SIZE];
+} efpak_inflate_point_t;
+
 typedef struct efpak_inflate
 {
   z_stream z;
 
 #define EFPAK_INFLATE_FLAG_EOI (1 << 1)
+#define EFPAK_INFLATE_FLAG_EOS (1 << 2)
   uint32_t flags;
 
   uint8_t* obuf;
   size_t osize;
 
+  /* zlib allocations arena, following obuf */
+  uint8_t* arena;
+  size_t arena_size;
+  size_t arena_off;
+
+  /* access points recorded every point_span raw bytes at most, if */
+  /* not 0, up to point_max ones. the span doubles once the maximum */
+  /* is reached, every other point being removed. offsets relative */
+  /* to ibase, and raw_base the raw offset the decoder started at. */
+  efpak_inflate_point_t* points;
+  size_t point_count;
+  size_t point_size;
+  size_t point_max;
+  size_t point_span;
+  const uint8_t* ibase;
+  uint64_t raw_base;
+
 } efpak_inflate_t;
 
 
+/* library decoders state (zstd, lz4, xz) */
+
+typedef struct efpak_decoder
+{
+  /* library specific context */
+  void* dctx;
+
+  /* offset in input block memory */
+  size_t ipos;
+
+  /* last decoder size hint, 0 at frame end */
+  size_t hint;
+
+  uint8_t* obuf;
+  size_t osize;
+
+} efpak_decoder_t;
+
+
+/* parallel inflate of indexed blocks */
+/* index spans are decoded by batch, one span per slot */
+
+typedef struct efpak_pinflate_slot
+{
+  /* decoder context, z for zlib */
+  z_stream z;
+  void* ctx;
+
+  /* decoded span, and its crc32 for zlib */
+  uint8_t* obuf;
+  size_t osize;
+  uLong crc;
+
+  int err;
+
+} efpak_pinflate_slot_t;
+
+
+typedef struct efpak_pinflate
+{
+  efpak_bcomp_t comp;
+  efpak_pool_t* pool;
+
+  efpak_pinflate_slot_t* slots;
+  size_t slot_count;
+  size_t max_span_size;
+
+  /* index entry of the first slot, decoded slot count */
+  size_t batch_entry;
+  size_t batch_count;
+
+  /* current slot and offset in slot */
+  size_t slot_pos;
+  size_t slot_off;
+
+  /* block raw data size */
+  size_t raw_size;
+
+  /* zlib spans crc32 combined in order, up to the entry crc_entry */
+  /* excluded. checked against the gzip trailer at the block end. */
+  uLong crc;
+  size_t crc_entry;
+
+} efpak_pinflate_t;
+
+
 typedef struct efpak_imem
 {
   /* input block memory */
@@ -188,15 +473,71 @@ typedef struct efpak_imem
   size_t size;
   size_t off;
 
-  /* zlib memory specific */
+  /* chunk index, or NULL */
+  const efpak_index_ext_t* index;
+
+  /* streamed memory specific */
+  const uint8_t* oblock_data;
+  size_t oblock_size;
+  int (*next_oblock)(struct efpak_imem*, const uint8_t**, size_t*);
+  int (*restart)(struct efpak_imem*, size_t);
+
+  /* output buffers ring of batched reads, so that several output */
+  /* blocks are valid together. the first one is the decoder own */
+  /* buffer, set back at the block end, and the others allocated by */
+  /* the first batch. ring_count is 0 if the decoder output cannot */
+  /* be redirected with set_obuf. */
+#define EFPAK_IMEM_RING_SIZE 8
+  void (*set_obuf)(struct efpak_imem*, uint8_t*);
+  uint8_t* ring[EFPAK_IMEM_RING_SIZE];
+  size_t ring_count;
+  size_t ring_pos;
+  size_t ring_osize;
+
+  /* restart without index at the decoder access point closest to */
+  /* the raw offset, or NULL if the decoder cannot go backward */
+  int (*rewind)(struct efpak_imem*, size_t);
+
+  /* zlib access points span and memory, 0 for none */
+  size_t point_span;
+  size_t point_mem_size;
+
+  /* streamed input, fd is -1 if the whole block data is in memory. */
+  /* otherwise data is a window in ibuf refilled from fd, and irem */
+  /* the block data size not yet read, from the file offset foff. if */
+  /* win_size is not 0, the windows are mapped at map_addr instead. */
+  int fd;
+  uint8_t* ibuf;
+  uint64_t irem;
+  uint64_t foff;
+  size_t win_size;
+  void* map_addr;
+  size_t map_size;
+
+  /* zlib memory specific. the context is kept initialized between */
+  /* blocks if has_inflate, and reset for the next zlib block. */
   efpak_inflate_t inflate;
-  const uint8_t* inflate_data;
-  size_t inflate_size;
+  unsigned int has_inflate;
+
+  /* one shot zlib decoder, kept between blocks, or NULL */
+  void* oneshot_dctx;
+
+  /* other decoders memory specific */
+  efpak_decoder_t decoder;
+
+  /* parallel zlib memory specific */
+  efpak_pinflate_t pinflate;
 
   int (*seek)(struct efpak_imem*, size_t);
   int (*next)(struct efpak_imem*, const uint8_t**, size_t*);
   void (*fini)(struct efpak_imem*);
 
+  /* next ranges valid together, a single next one by default */
+  int (*next_batch)(struct efpak_imem*, struct iovec*, size_t*, size_t*);
+
+  /* input block memory size consumed by the decoder */
+  size_t (*get_ipos)(struct efpak_imem*);
+
 } efpak_imem_t;
 
 
@@ -218,35 +559,197 @@ typedef struct efpak_istream
   /* current block memory */
   efpak_imem_t mem;
 
+  /* current block extents, or NULL if not sparse. the offset is */
+  /* in the block contents, and the extent the current or next one */
+  const efpak_sparse_ext_t* sparse;
+  size_t sparse_off;
+  size_t sparse_extent;
+
+  /* decompression workers, NULL if single threaded */
+  efpak_pool_t* pool;
+  size_t thread_count;
+
+  /* largest decoder dictionary accepted, 0 for no limit */
+  size_t max_dict_size;
+
+  /* zlib access points span and memory bound, 0 for none */
+  size_t point_span;
+  size_t point_mem_size;
+
+  /* largest zlib block raw size decoded in one shot, 0 for none */
+  size_t oneshot_size;
+
+  /* table of contents entries, or NULL if none */
+  const efpak_toc_entry_t* toc;
+  size_t toc_count;
+
+  /* the package the data belongs to, or NULL if owned */
+  const struct efpak_package* package;
+
+  /* sequential input file descriptor, or -1 if data is mapped. the */
+  /* current header is read in hbuf, and its data through ibuf. irem */
+  /* is the current block data size not yet read, and foff the file */
+  /* offset. seekable files are mapped by windows of win_size bytes */
+  /* if not 0, ibuf being unused. */
+  int fd;
+  uint8_t* hbuf;
+  size_t hbuf_size;
+  uint8_t* ibuf;
+  uint64_t irem;
+  uint64_t foff;
+  size_t win_size;
+  unsigned int is_fd_owned;
+
+  /* mapped package file descriptor, or -1 if the data is not owned */
+  /* or not mapped. the package pages are advised ra_size bytes ahead */
+  /* of the consumed data, up to ra_off, and dropped behind it from */
+  /* drop_off. no hint is given if ra_size is 0. */
+  int map_fd;
+  size_t ra_size;
+  size_t ra_off;
+  size_t drop_off;
+
 } efpak_istream_t;
 
 
+/* shared package and random access file reads */
+
+typedef struct efpak_chunk
+{
+  /* block header and chunk index in the block, NULL if unused */
+  const efpak_header_t* header;
+  size_t index;
+
+  /* valid size, smaller for the block last chunk */
+  size_t size;
+
+  /* last use, for least recently used eviction */
+  uint64_t stamp;
+
+  uint8_t* data;
+
+} efpak_chunk_t;
+
+
+typedef struct efpak_package
+{
+  /* mapped package data, read only once opened. it is shared by */
+  /* cursors, istreams initialized with the package, each one with */
+  /* its own decoder, that can be used concurrently. */
+  const uint8_t* data;
+  size_t size;
+
+  /* block headers, in package order */
+  const efpak_header_t** headers;
+  size_t block_count;
+
+  /* decompressed chunks, shared by the package files */
+  pthread_mutex_t lock;
+  efpak_chunk_t* chunks;
+  size_t chunk_count;
+  uint64_t stamp;
+
+} efpak_package_t;
+
+
+typedef struct efpak_file
+{
+  efpak_package_t* package;
+  const efpak_header_t* header;
+  size_t size;
+
+  /* file own cursor and decoded chunk */
+  efpak_istream_t is;
+  uint8_t* buf;
+} efpak_file_t;
+
+
 typedef struct efpak_ostream
 {
   /* output file descriptor */
   int fd;
+
+  /* write a chunk index for compressed blocks */
+#define EFPAK_OSTREAM_FLAG_INDEX (1 << 0)
+  /* store zero runs of disk and partition blocks as holes */
+#define EFPAK_OSTREAM_FLAG_SPARSE (1 << 1)
+  /* store only the used blocks of known partition filesystems */
+#define EFPAK_OSTREAM_FLAG_USED (1 << 2)
+  /* end the package with a table of contents */
+#define EFPAK_OSTREAM_FLAG_TOC (1 << 3)
+  uint32_t flags;
+
+  /* codec used for large enough blocks, 0 for default level */
+  efpak_bcomp_t comp;
+  int level;
+
+  /* codec selection, and the largest compressed to raw size */
+  /* ratio in percent for a block to be compressed */
+  efpak_comp_policy_t policy;
+  unsigned int max_ratio;
+
+  /* compression workers, NULL if single threaded */
+  efpak_pool_t* pool;
+  size_t thread_count;
+
 } efpak_ostream_t;
 
 
 /* input stream exported api */
 
+const efpak_ext_header_t* efpak_header_find_ext
+(const efpak_header_t*, uint16_t);
+uint64_t efpak_header_get_size(const efpak_header_t*);
+
 int efpak_istream_init_with_file(efpak_istream_t*, const char*);
 int efpak_istream_init_with_mem(efpak_istream_t*, const uint8_t*, size_t);
+int efpak_istream_init_with_fd(efpak_istream_t*, int);
+int efpak_istream_init_with_fd_window(efpak_istream_t*, int, size_t);
+int efpak_istream_init_with_package(efpak_istream_t*, efpak_package_t*);
 void efpak_istream_fini(efpak_istream_t*);
+int efpak_istream_set_thread_count(efpak_istream_t*, size_t);
+void efpak_istream_set_max_dict_size(efpak_istream_t*, size_t);
+void efpak_istream_set_readahead(efpak_istream_t*, size_t);
+void efpak_istream_set_checkpoints(efpak_istream_t*, size_t, size_t);
+void efpak_istream_set_oneshot_size(efpak_istream_t*, size_t);
 int efpak_istream_next_block(efpak_istream_t*, const efpak_header_t**);
+int efpak_istream_seek_block
+(efpak_istream_t*, size_t, const efpak_header_t**);
+int efpak_istream_find_file(efpak_istream_t*, const char*, size_t*);
 int efpak_istream_start_block(efpak_istream_t*);
 void efpak_istream_end_block(efpak_istream_t*);
 int efpak_istream_seek(efpak_istream_t*, size_t);
 int efpak_istream_next(efpak_istream_t*, const uint8_t**, size_t*);
+int efpak_istream_next_zero(efpak_istream_t*, size_t*);
+int efpak_istream_next_copy(efpak_istream_t*, int, size_t*);
+int efpak_istream_next_batch
+(efpak_istream_t*, struct iovec*, size_t*, size_t*);
+
+int efpak_package_open(efpak_package_t*, const char*);
+void efpak_package_close(efpak_package_t*);
+const efpak_header_t* efpak_package_get_block
+(const efpak_package_t*, size_t);
+int efpak_package_open_file(efpak_package_t*, efpak_file_t*, const char*);
+void efpak_file_close(efpak_file_t*);
+int efpak_file_pread(efpak_file_t*, uint8_t*, size_t*, size_t);
 
 int efpak_ostream_init_with_file(efpak_ostream_t*, const char*);
 void efpak_ostream_fini(efpak_ostream_t*);
+int efpak_ostream_set_thread_count(efpak_ostream_t*, size_t);
+void efpak_ostream_set_flags(efpak_ostream_t*, uint32_t);
+int efpak_ostream_set_comp(efpak_ostream_t*, efpak_bcomp_t, int);
+int efpak_ostream_set_policy
+(efpak_ostream_t*, efpak_comp_policy_t, unsigned int);
 int efpak_ostream_add_disk(efpak_ostream_t*, const char*);
 int efpak_ostream_add_part
 (efpak_ostream_t*, const char*, efpak_partid_t, efpak_fsid_t);
 int efpak_ostream_add_file(efpak_ostream_t*, const char*, const char*);
 int efpak_ostream_add_hook
 (efpak_ostream_t*, const char*, const char*, uint32_t, uint32_t);
+int efpak_ostream_add_delta
+(efpak_ostream_t*, const char*, const char*, efpak_partid_t, efpak_fsid_t);
+int efpak_ostream_add_efpak_delta
+(efpak_ostream_t*, const char*, const char*);
 
 
 #endif /* EFPAK_H_INCLUDED */
@@ -1,7 +1,10 @@
 /* tool to manage efpak files */
 
 
+#define _LARGEFILE64_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdint.h>
@@ -11,6 +14,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <dirent.h>
 #include "libefpak.h"
 #include "disk.h"
@@ -27,107 +31,389 @@ do {					\
 } while (0)
 
 
-static int do_list(int ac, const char** av)
+/* command line options */
+
+typedef struct
 {
-  const char* const path = av[2];
-  efpak_istream_t is;
-  const efpak_header_t* h;
-  int err = -1;
-  size_t i;
+  size_t thread_count;
+  uint32_t ostream_flags;
+  efpak_bcomp_t comp;
+  int level;
+  efpak_comp_policy_t policy;
+  unsigned int max_ratio;
+  size_t max_dict_size;
+  size_t readahead_size;
+  size_t oneshot_size;
+  uint32_t disk_flags;
+} cmd_opts_t;
+
+static cmd_opts_t opts;
+
+static void init_opts(cmd_opts_t* o)
+{
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  o->thread_count = (n > 0) ? (size_t)n : 1;
+  o->ostream_flags = 0;
+  o->comp = EFPAK_BCOMP_ZLIB;
+  o->level = 0;
+  o->policy = EFPAK_COMP_POLICY_FIXED;
+  o->max_ratio = 90;
+  o->max_dict_size = 0;
+  o->readahead_size = 8 * 1024 * 1024;
+#ifdef CONFIG_LIBDEFLATE
+  o->oneshot_size = 16 * 1024 * 1024;
+#else
+  o->oneshot_size = 0;
+#endif /* CONFIG_LIBDEFLATE */
+  o->disk_flags = 0;
+}
 
-  if (ac != 3) goto on_error_0;
+static int get_comp_by_name(const char* s, efpak_bcomp_t* comp)
+{
+  if (strcmp(s, "zlib") == 0) *comp = EFPAK_BCOMP_ZLIB;
+  else if (strcmp(s, "zstd") == 0) *comp = EFPAK_BCOMP_ZSTD;
+  else if (strcmp(s, "lz4") == 0) *comp = EFPAK_BCOMP_LZ4;
+  else if (strcmp(s, "xz") == 0) *comp = EFPAK_BCOMP_XZ;
+  else return -1;
+  return 0;
+}
 
-  if (efpak_istream_init_with_file(&is, path)) goto on_error_0;
+static int get_policy_by_name(const char* s, efpak_comp_policy_t* policy)
+{
+  if (strcmp(s, "fixed") == 0) *policy = EFPAK_COMP_POLICY_FIXED;
+  else if (strcmp(s, "ratio") == 0) *policy = EFPAK_COMP_POLICY_RATIO;
+  else if (strcmp(s, "size") == 0) *policy = EFPAK_COMP_POLICY_SIZE;
+  else if (strcmp(s, "speed") == 0) *policy = EFPAK_COMP_POLICY_SPEED;
+  else return -1;
+  return 0;
+}
 
-  for (i = 0; 1; ++i)
+static int parse_opts(cmd_opts_t* o, int* ac, const char*** av)
+{
+  /* options are given before the command name. av[0] is not */
+  /* preserved, as not used by commands. */
+
+  const char* s;
+  long x;
+
+  while ((*ac > 1) && ((*av)[1][0] == '-'))
   {
-    if (efpak_istream_next_block(&is, &h)) goto on_error_1;
-    if (h == NULL) break ;
+    s = (*av)[1];
+
+    if (strcmp(s, "-j") == 0)
+    {
+      if (*ac <= 2) return -1;
+      x = strtol((*av)[2], NULL, 10);
+      if (x <= 0) return -1;
+      o->thread_count = (size_t)x;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-z") == 0)
+    {
+      if (*ac <= 2) return -1;
+      if (get_comp_by_name((*av)[2], &o->comp)) return -1;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-l") == 0)
+    {
+      if (*ac <= 2) return -1;
+      o->level = (int)strtol((*av)[2], NULL, 10);
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-p") == 0)
+    {
+      if (*ac <= 2) return -1;
+      if (get_policy_by_name((*av)[2], &o->policy)) return -1;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-r") == 0)
+    {
+      if (*ac <= 2) return -1;
+      x = strtol((*av)[2], NULL, 10);
+      if ((x <= 0) || (x > 100)) return -1;
+      o->max_ratio = (unsigned int)x;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-m") == 0)
+    {
+      if (*ac <= 2) return -1;
+      x = strtol((*av)[2], NULL, 10);
+      if (x < 0) return -1;
+      o->max_dict_size = (size_t)x;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-a") == 0)
+    {
+      if (*ac <= 2) return -1;
+      x = strtol((*av)[2], NULL, 10);
+      if (x < 0) return -1;
+      o->readahead_size = (size_t)x;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-o") == 0)
+    {
+      if (*ac <= 2) return -1;
+      x = strtol((*av)[2], NULL, 10);
+      if (x < 0) return -1;
+      o->oneshot_size = (size_t)x;
+      *ac -= 2;
+      *av += 2;
+    }
+    else if (strcmp(s, "-i") == 0)
+    {
+      o->ostream_flags |= EFPAK_OSTREAM_FLAG_INDEX;
+      *ac -= 1;
+      *av += 1;
+    }
+    else if (strcmp(s, "-s") == 0)
+    {
+      o->ostream_flags |= EFPAK_OSTREAM_FLAG_SPARSE;
+      *ac -= 1;
+      *av += 1;
+    }
+    else if (strcmp(s, "-u") == 0)
+    {
+      o->ostream_flags |= EFPAK_OSTREAM_FLAG_USED;
+      *ac -= 1;
+      *av += 1;
+    }
+    else if (strcmp(s, "-t") == 0)
+    {
+      o->ostream_flags |= EFPAK_OSTREAM_FLAG_TOC;
+      *ac -= 1;
+      *av += 1;
+    }
+    else if (strcmp(s, "-c") == 0)
+    {
+      o->disk_flags |= DISK_FLAG_COMPARE;
+      *ac -= 1;
+      *av += 1;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int init_ostream(efpak_ostream_t* os, const char* path)
+{
+  /* open an output stream and apply command line options */
+
+  if (efpak_ostream_init_with_file(os, path)) return -1;
+
+  efpak_ostream_set_flags(os, opts.ostream_flags);
+
+  if (efpak_ostream_set_comp(os, opts.comp, opts.level))
+  {
+    efpak_ostream_fini(os);
+    return -1;
+  }
+
+  if (efpak_ostream_set_policy(os, opts.policy, opts.max_ratio))
+  {
+    efpak_ostream_fini(os);
+    return -1;
+  }
+
+  if (efpak_ostream_set_thread_count(os, opts.thread_count))
+  {
+    efpak_ostream_fini(os);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int init_istream(efpak_istream_t* is, const char* path)
+{
+  /* open an input stream and apply command line options. the */
+  /* path - reads the package sequentially from the standard input */
+
+  if (strcmp(path, "-") == 0)
+  {
+    if (efpak_istream_init_with_fd(is, STDIN_FILENO)) return -1;
+  }
+  else if (efpak_istream_init_with_file(is, path))
+  {
+    return -1;
+  }
 
-    printf("header[%zu]:\n", i);
-    printf(".vers          : 0x%02x\n", h->vers);
-    printf(".type          : 0x%02x\n", h->type);
-    printf(".comp          : 0x%02x\n", h->comp);
-    printf(".header_size   : %" PRIu64 "\n", h->header_size);
-    printf(".comp_data_size: %" PRIu64 "\n", h->comp_data_size);
-    printf(".raw_data_size : %" PRIu64 "\n", h->raw_data_size);
+  if (efpak_istream_set_thread_count(is, opts.thread_count))
+  {
+    efpak_istream_fini(is);
+    return -1;
+  }
+
+  efpak_istream_set_max_dict_size(is, opts.max_dict_size);
+  efpak_istream_set_readahead(is, opts.readahead_size);
+  efpak_istream_set_oneshot_size(is, opts.oneshot_size);
+
+  return 0;
+}
 
-    switch (h->type)
+static void print_header(size_t i, const efpak_header_t* h)
+{
+  const efpak_index_ext_t* index;
+  const efpak_dict_ext_t* dict;
+  const efpak_sparse_ext_t* sparse;
+
+  printf("header[%zu]:\n", i);
+  printf(".vers          : 0x%02x\n", h->vers);
+  printf(".type          : 0x%02x\n", h->type);
+  printf(".comp          : 0x%02x\n", h->comp);
+  printf(".header_size   : %" PRIu64 "\n", h->header_size);
+  printf(".comp_data_size: %" PRIu64 "\n", h->comp_data_size);
+  printf(".raw_data_size : %" PRIu64 "\n", h->raw_data_size);
+
+  index = (const efpak_index_ext_t*)efpak_header_find_ext(h, EFPAK_EXT_INDEX);
+  if (index != NULL) printf(".index_count   : %" PRIu32 "\n", index->count);
+
+  dict = (const efpak_dict_ext_t*)efpak_header_find_ext(h, EFPAK_EXT_DICT);
+  if (dict != NULL) printf(".dict_size     : %" PRIu32 "\n", dict->dict_size);
+
+  sparse = (const efpak_sparse_ext_t*)efpak_header_find_ext
+    (h, EFPAK_EXT_SPARSE);
+  if (sparse != NULL)
+  {
+    printf(".sparse_size   : %" PRIu64 "\n", sparse->size);
+    printf(".sparse_flags  : 0x%08x\n", sparse->flags);
+    printf(".extent_count  : %" PRIu32 "\n", sparse->count);
+  }
+
+  switch (h->type)
+  {
+  case EFPAK_BTYPE_FORMAT:
     {
-    case EFPAK_BTYPE_FORMAT:
-      {
-	const uint8_t* const s = h->u.format.signature;
-	printf(".signature     : %c%c%c%c\n", s[0], s[1], s[2], s[3]);
-	break ;
-      }
+      const uint8_t* const s = h->u.format.signature;
+      printf(".signature     : %c%c%c%c\n", s[0], s[1], s[2], s[3]);
+      break ;
+    }
 
-    case EFPAK_BTYPE_DISK:
-      {
-	break ;
-      }
+  case EFPAK_BTYPE_DISK:
+    {
+      break ;
+    }
 
-    case EFPAK_BTYPE_PART:
-      {
-	printf(".part_id       : 0x%02x\n", h->u.part.part_id);
-	printf(".fs_id         : 0x%02x\n", h->u.part.fs_id);
-	break ;
-      }
+  case EFPAK_BTYPE_PART:
+    {
+      printf(".part_id       : 0x%02x\n", h->u.part.part_id);
+      printf(".fs_id         : 0x%02x\n", h->u.part.fs_id);
+      break ;
+    }
 
-    case EFPAK_BTYPE_FILE:
+  case EFPAK_BTYPE_DELTA:
+    {
+      const efpak_delta_header_t* const d = &h->u.delta;
+      printf(".part_id       : 0x%02x\n", d->part.part_id);
+      printf(".fs_id         : 0x%02x\n", d->part.fs_id);
+      printf(".src_size      : %" PRIu64 "\n", d->src_size);
+      printf(".src_crc       : 0x%08x\n", d->src_crc);
+      printf(".dst_size      : %" PRIu64 "\n", d->dst_size);
+      break ;
+    }
+
+  case EFPAK_BTYPE_TOC:
+    {
+      printf(".toc_count     : %" PRIu32 "\n", h->u.toc.count);
+      break ;
+    }
+
+  case EFPAK_BTYPE_FILE:
+    {
+      const char* s = "invalid";
+      size_t i;
+      for (i = 0; i != h->u.file.path_len; ++i)
       {
-	const char* s = "invalid";
-	size_t i;
-	for (i = 0; i != h->u.file.path_len; ++i)
+	if (h->u.file.path[i] == 0)
 	{
-	  if (h->u.file.path[i] == 0)
-	  {
-	    s = (const char*)h->u.file.path;
-	    break ;
-	  }
+	  s = (const char*)h->u.file.path;
+	  break ;
 	}
-	printf(".path          : %s\n", s);
-	break ;
       }
+      printf(".path          : %s\n", s);
+      break ;
+    }
 
-    case EFPAK_BTYPE_HOOK:
+  case EFPAK_BTYPE_HOOK:
+    {
+      const uint32_t wflags = h->u.hook.when_flags;
+      const uint32_t eflags = h->u.hook.exec_flags;
+      const char* s = "invalid";
+      size_t i;
+
+      printf(".wflags        :");
+      if (wflags & EFPAK_HOOK_NOW) printf(" now");
+      if (wflags & EFPAK_HOOK_PREX) printf(" prex");
+      if (wflags & EFPAK_HOOK_POSTX) printf(" postx");
+      if (wflags & EFPAK_HOOK_COMPL) printf(" compl");
+      if (wflags & EFPAK_HOOK_MBR) printf(" mbr");
+      printf("\n");
+
+      printf(".eflags        :");
+      if (eflags & EFPAK_HOOK_EXECVE) printf(" execve");
+      printf("\n");
+
+      for (i = 0; i != h->u.hook.path_len; ++i)
       {
-	const uint32_t wflags = h->u.hook.when_flags;
-	const uint32_t eflags = h->u.hook.exec_flags;
-	const char* s = "invalid";
-	size_t i;
-
-	printf(".wflags        :");
-	if (wflags & EFPAK_HOOK_NOW) printf(" now");
-	if (wflags & EFPAK_HOOK_PREX) printf(" prex");
-	if (wflags & EFPAK_HOOK_POSTX) printf(" postx");
-	if (wflags & EFPAK_HOOK_COMPL) printf(" compl");
-	if (wflags & EFPAK_HOOK_MBR) printf(" mbr");
-	printf("\n");
-
-	printf(".eflags        :");
-	if (eflags & EFPAK_HOOK_EXECVE) printf(" execve");
-	printf("\n");
-
-	for (i = 0; i != h->u.hook.path_len; ++i)
+	if (h->u.hook.path[i] == 0)
 	{
-	  if (h->u.hook.path[i] == 0)
-	  {
-	    s = (const char*)h->u.hook.path;
-	    break ;
-	  }
+	  s = (const char*)h->u.hook.path;
+	  break ;
 	}
-	printf(".path          : %s\n", s);
-
-	break ;
       }
+      printf(".path          : %s\n", s);
 
-    default:
-      {
-	break ;
-      }
+      break ;
+    }
+
+  default:
+    {
+      break ;
     }
+  }
+
+  printf("\n");
+}
 
-    printf("\n");
+static int do_list(int ac, const char** av)
+{
+  const char* const path = av[2];
+  efpak_istream_t is;
+  const efpak_header_t* h;
+  int err = -1;
+  size_t i;
+
+  if ((ac != 3) && (ac != 4)) goto on_error_0;
+
+  if (efpak_istream_init_with_file(&is, path)) goto on_error_0;
+
+  if (ac == 4)
+  {
+    /* only the file block whose destination path is given */
+    if (efpak_istream_find_file(&is, av[3], &i)) goto on_error_1;
+    if (i == (size_t)-1) goto on_error_1;
+    if (efpak_istream_seek_block(&is, i, &h)) goto on_error_1;
+    if (h == NULL) goto on_error_1;
+    print_header(i, h);
+    err = 0;
+    goto on_error_1;
+  }
+
+  for (i = 0; 1; ++i)
+  {
+    if (efpak_istream_next_block(&is, &h)) goto on_error_1;
+    if (h == NULL) break ;
+    print_header(i, h);
   }
 
   err = 0;
@@ -165,7 +451,7 @@ static int do_add_disk(int ac, const char** av)
   int err = -1;
 
   if (ac != 4) goto on_error_0;
-  if (efpak_ostream_init_with_file(&os, efpak_path)) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
   if (efpak_ostream_add_disk(&os, disk_path)) goto on_error_1;
   err = 0;
 
@@ -175,6 +461,40 @@ static int do_add_disk(int ac, const char** av)
   return err;
 }
 
+static int get_part_by_name
+(
+ const char* part_name, const char* fs_name,
+ efpak_partid_t* part_id, efpak_fsid_t* fs_id
+)
+{
+  /* fs_name NULL for the partition default */
+
+  if (strcmp(part_name, "boot") == 0)
+  {
+    *part_id = EFPAK_PARTID_BOOT;
+    if (fs_name == NULL) fs_name = "vfat";
+  }
+  else if (strcmp(part_name, "root") == 0)
+  {
+    *part_id = EFPAK_PARTID_ROOT;
+    if (fs_name == NULL) fs_name = "squash";
+  }
+  else if (strcmp(part_name, "app") == 0)
+  {
+    *part_id = EFPAK_PARTID_APP;
+    if (fs_name == NULL) fs_name = "ext3";
+  }
+  else return -1;
+
+  if (strcmp(fs_name, "vfat") == 0) *fs_id = EFPAK_FSID_VFAT;
+  else if (strcmp(fs_name, "squash") == 0) *fs_id = EFPAK_FSID_SQUASH;
+  else if (strcmp(fs_name, "ext2") == 0) *fs_id = EFPAK_FSID_EXT2;
+  else if (strcmp(fs_name, "ext3") == 0) *fs_id = EFPAK_FSID_EXT3;
+  else return -1;
+
+  return 0;
+}
+
 static int do_add_part(int ac, const char** av)
 {
   const char* const efpak_path = av[2];
@@ -193,30 +513,9 @@ static int do_add_part(int ac, const char** av)
     fs_name = NULL;
   }
 
-  if (strcmp(part_name, "boot") == 0)
-  {
-    part_id = EFPAK_PARTID_BOOT;
-    if (fs_name == NULL) fs_name = "vfat";
-  }
-  else if (strcmp(part_name, "root") == 0)
-  {
-    part_id = EFPAK_PARTID_ROOT;
-    if (fs_name == NULL) fs_name = "squash";
-  }
-  else if (strcmp(part_name, "app") == 0)
-  {
-    part_id = EFPAK_PARTID_APP;
-    if (fs_name == NULL) fs_name = "ext3";
-  }
-  else goto on_error_0;
+  if (get_part_by_name(part_name, fs_name, &part_id, &fs_id)) goto on_error_0;
 
-  if (strcmp(fs_name, "vfat") == 0) fs_id = EFPAK_FSID_VFAT;
-  else if (strcmp(fs_name, "squash") == 0) fs_id = EFPAK_FSID_SQUASH;
-  else if (strcmp(fs_name, "ext2") == 0) fs_id = EFPAK_FSID_EXT2;
-  else if (strcmp(fs_name, "ext3") == 0) fs_id = EFPAK_FSID_EXT3;
-  else goto on_error_0;
-
-  if (efpak_ostream_init_with_file(&os, efpak_path)) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
   if (efpak_ostream_add_part(&os, part_path, part_id, fs_id)) goto on_error_1;
   err = 0;
 
@@ -226,6 +525,53 @@ static int do_add_part(int ac, const char** av)
   return err;
 }
 
+static int do_add_delta(int ac, const char** av)
+{
+  const char* const efpak_path = av[2];
+  const char* const src_path = av[3];
+  const char* const dst_path = av[4];
+  const char* const part_name = av[5];
+  const char* fs_name = av[6];
+
+  efpak_partid_t part_id;
+  efpak_fsid_t fs_id;
+  efpak_ostream_t os;
+  int err = -1;
+
+  if (ac != 7)
+  {
+    if (ac != 6) goto on_error_0;
+    fs_name = NULL;
+  }
+
+  if (get_part_by_name(part_name, fs_name, &part_id, &fs_id)) goto on_error_0;
+
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
+  err = efpak_ostream_add_delta(&os, src_path, dst_path, part_id, fs_id);
+  efpak_ostream_fini(&os);
+
+ on_error_0:
+  return err;
+}
+
+static int do_mkdelta(int ac, const char** av)
+{
+  const char* const efpak_path = av[2];
+  const char* const old_path = av[3];
+  const char* const new_path = av[4];
+
+  efpak_ostream_t os;
+  int err = -1;
+
+  if (ac != 5) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
+  err = efpak_ostream_add_efpak_delta(&os, old_path, new_path);
+  efpak_ostream_fini(&os);
+
+ on_error_0:
+  return err;
+}
+
 static int do_add_file(int ac, const char** av)
 {
   const char* const efpak_path = av[2];
@@ -237,7 +583,7 @@ static int do_add_file(int ac, const char** av)
 
   if (ac != 5) goto on_error_0;
 
-  if (efpak_ostream_init_with_file(&os, efpak_path)) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
   if (efpak_ostream_add_file(&os, src_path, dst_path)) goto on_error_1;
   err = 0;
 
@@ -390,7 +736,7 @@ static int do_add_dir(int ac, const char** av)
   int err = -1;
 
   if (ac != 5) goto on_error_0;
-  if (efpak_ostream_init_with_file(&os, efpak_path)) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
 
   ad.os = &os;
 
@@ -450,7 +796,7 @@ static int do_add_hook(int ac, const char** av)
 
   if (ac != 5) goto on_error_0;
 
-  if (efpak_ostream_init_with_file(&os, efpak_path)) goto on_error_0;
+  if (init_ostream(&os, efpak_path)) goto on_error_0;
 
   wflags = 0;
   k = 0;
@@ -482,6 +828,77 @@ static int do_add_hook(int ac, const char** av)
   return err;
 }
 
+static int extract_block
+(efpak_istream_t* is, const efpak_header_t* h, const char* path)
+{
+  struct iovec iov[16];
+  unsigned int is_hole = 0;
+  uint64_t total = 0;
+  size_t count;
+  size_t size;
+  int err = -1;
+  int fd;
+
+  /* create the file */
+  fd = open(path, O_RDWR | O_TRUNC | O_CREAT, 0755);
+  if (fd == -1) goto on_error_0;
+
+  /* extract the block */
+  if (efpak_istream_start_block(is)) goto on_error_1;
+
+  while (1)
+  {
+    /* zero runs are left as holes */
+    size = (size_t)-1;
+    if (efpak_istream_next_zero(is, &size)) goto on_error_2;
+
+    if (size != 0)
+    {
+      if (lseek64(fd, (off64_t)size, SEEK_CUR) == (off64_t)-1)
+	goto on_error_2;
+      total += (uint64_t)size;
+      is_hole = 1;
+      continue ;
+    }
+
+    /* uncompressed data are copied by the kernel if possible */
+    size = (size_t)-1;
+    if (efpak_istream_next_copy(is, fd, &size)) goto on_error_2;
+    if (size != 0)
+    {
+      total += (uint64_t)size;
+      is_hole = 0;
+      continue ;
+    }
+
+    /* decoded spans are written together */
+    count = sizeof(iov) / sizeof(iov[0]);
+    size = (size_t)-1;
+    if (efpak_istream_next_batch(is, iov, &count, &size)) goto on_error_2;
+
+    if (size == 0) break ;
+
+    if (writev(fd, iov, (int)count) != (ssize_t)size) goto on_error_2;
+    total += (uint64_t)size;
+    is_hole = 0;
+  }
+
+  /* truncated block data */
+  if (total != efpak_header_get_size(h)) goto on_error_2;
+
+  /* extend the file if it ends with a hole */
+  if (is_hole && ftruncate64(fd, (off64_t)total)) goto on_error_2;
+
+  err = 0;
+
+ on_error_2:
+  efpak_istream_end_block(is);
+ on_error_1:
+  close(fd);
+ on_error_0:
+  return err;
+}
+
 static int do_extract(int ac, const char** av)
 {
   const char* const efpak_path = av[2];
@@ -491,12 +908,10 @@ static int do_extract(int ac, const char** av)
   const efpak_header_t* h;
   efpak_istream_t is;
   int err = -1;
-  int fd;
   unsigned int n = 0;
-  size_t size;
-  const uint8_t* data;
+  size_t i;
 
-  if (ac != 4) goto on_error_0;
+  if ((ac != 4) && (ac != 5)) goto on_error_0;
 
   errno = 0;
   if (mkdir(dir_path, 0755))
@@ -504,48 +919,36 @@ static int do_extract(int ac, const char** av)
     if (errno != EEXIST) goto on_error_0;
   }
 
-  if (efpak_istream_init_with_file(&is, efpak_path)) goto on_error_0;
+  if (init_istream(&is, efpak_path)) goto on_error_0;
+
+  if (ac == 5)
+  {
+    /* only the file block whose destination path is given */
+    if (efpak_istream_find_file(&is, av[4], &i)) goto on_error_1;
+    if ((i == (size_t)-1) || (i == 0)) goto on_error_1;
+    if (efpak_istream_seek_block(&is, i, &h)) goto on_error_1;
+    if (h == NULL) goto on_error_1;
+
+    /* named as when extracting all the blocks */
+    snprintf(full_path, sizeof(full_path), "%s/%04x", dir_path,
+	     (unsigned int)(i - 1));
+    full_path[sizeof(full_path) - 1] = 0;
+    if (extract_block(&is, h, full_path)) goto on_error_1;
+
+    err = 0;
+    goto on_error_1;
+  }
 
   while (1)
   {
     if (efpak_istream_next_block(&is, &h)) goto on_error_1;
     if (h == NULL) break ;
     if (h->type == EFPAK_BTYPE_FORMAT) continue ;
+    if (h->type == EFPAK_BTYPE_TOC) continue ;
 
-    /* create the file */
     snprintf(full_path, sizeof(full_path), "%s/%04x", dir_path, n++);
     full_path[sizeof(full_path) - 1] = 0;
-    fd = open(full_path, O_RDWR | O_TRUNC | O_CREAT, 0755);
-    if (fd == -1) goto on_error_1;
-
-    /* extract the block */
-    if (efpak_istream_start_block(&is))
-    {
-      close(fd);
-      goto on_error_1;
-    }
-
-    while (1)
-    {
-      size = (size_t)-1;
-      if (efpak_istream_next(&is, &data, &size))
-      {
-	close(fd);
-	goto on_error_1;
-      }
-
-      if (size == 0) break ;
-
-      if (write(fd, data, size) != (ssize_t)size)
-      {
-	close(fd);
-	goto on_error_1;
-      }
-    }
-
-    close(fd);
-
-    efpak_istream_end_block(&is);
+    if (extract_block(&is, h, full_path)) goto on_error_1;
   }
 
   err = 0;
@@ -566,15 +969,23 @@ static int do_install(int ac, const char** av)
 
   if (ac != 4) goto on_error_0;
 
-  if (efpak_istream_init_with_file(&is, efpak_path)) goto on_error_0;
+  if (init_istream(&is, efpak_path)) goto on_error_0;
 
   if (strcmp(disk_name, "root") == 0) err = disk_open_root(&disk);
   else err = disk_open_dev(&disk, disk_name);
   if (err) goto on_error_1;
 
+  disk_set_flags(&disk, opts.disk_flags);
+
   err = disk_install_with_efpak(&disk, &is);
   if (err) goto on_error_2;
 
+  if (opts.disk_flags & DISK_FLAG_COMPARE)
+  {
+    printf("written: %" PRIu64 "\n", disk.write_size);
+    printf("skipped: %" PRIu64 "\n", disk.skip_size);
+  }
+
  on_error_2:
   disk_close(&disk);
  on_error_1:
@@ -644,8 +1055,31 @@ static int do_send(int ac, const char** av)
 static int do_help(int ac, const char** av)
 {
   const char* const usage =
+    ". options, given before the command: \n"
+    " -j thread_count: (de)compression threads (default: online cpus) \n"
+    " -z {zlib,zstd,lz4,xz}: compression codec (default: zlib) \n"
+    " -l level: compression level (default: codec default) \n"
+    " -p {fixed,ratio,size,speed}: per block codec selection, from \n"
+    "    samples of the block data (default: fixed) \n"
+    "    fixed: the -z codec for all blocks larger than 64KB \n"
+    "    ratio: the -z codec if the ratio is below the -r one \n"
+    "    size: the available codec giving the smallest data \n"
+    "    speed: the fastest to decode codec below the -r ratio \n"
+    " -r percent: compressed to raw size ratio (default: 90) \n"
+    " -i: write a chunk index in compressed blocks, for fast seeking \n"
+    "     and parallel decompression \n"
+    " -s: store zero runs of disks and partitions as holes \n"
+    " -u: store only the used blocks of ext2, ext3 and vfat partitions \n"
+    " -t: end the package with a table of contents, for fast lookups \n"
+    " -m size: refuse blocks needing a larger decoder dictionary \n"
+    " -a size: package data read ahead and dropped from the page \n"
+    "    cache once read, 0 to disable (default: 8388608) \n"
+    " -o size: decode the zlib blocks up to size bytes whole, faster \n"
+    "    with libdeflate (default: 16777216 with libdeflate, else 0) \n"
+    " -c: on install, only write the sectors differing from the device \n"
+    "\n"
     ". list package contents: \n"
-    " efpak list \n"
+    " efpak list efpak_path [dst_path] \n"
     "\n"
     ". create a new package: \n"
     " efpak create efpak_path \n"
@@ -653,15 +1087,23 @@ static int do_help(int ac, const char** av)
     ". adding contents: \n"
     " efpak add_disk efpak_path disk_path \n"
     " efpak add_part efpak_path part_path {boot,root,app} fs_type \n"
+    " efpak add_delta efpak_path old_part_path new_part_path \n"
+    "   {boot,root,app} fs_type \n"
     " efpak add_file efpak_path src_path dst_path \n"
     " efpak add_dir efpak_path src_path dst_path \n"
     " efpak add_hook efpak_path data_path {now,prex,postx,compl,mbr} \n"
     "\n"
+    ". creating a delta package, updating old_efpak installations: \n"
+    " efpak mkdelta efpak_path old_efpak_path new_efpak_path \n"
+    "\n"
     ". extracting contents: \n"
-    " efpak extract efpak_path dest_dir \n"
+    " efpak extract efpak_path dest_dir [dst_path] \n"
     "\n"
     ". local disk install: \n"
     " efpak install efpak_path {root,disk_name(mmcblk0,sdd...)} \n"
+    " efpak_path - reads the package from the standard input, to \n"
+    " install while it is downloaded: \n"
+    " curl url | efpak install - mmcblk0 \n"
     "\n"
     ". send package to remote device: \n"
     " efpak send efpak_path dev_addr \n"
@@ -684,9 +1126,11 @@ int main(int ac, const char** av)
     { "create", do_create },
     { "add_disk", do_add_disk },
     { "add_part", do_add_part },
+    { "add_delta", do_add_delta },
     { "add_file", do_add_file },
     { "add_dir", do_add_dir },
     { "add_hook", do_add_hook },
+    { "mkdelta", do_mkdelta },
     { "extract", do_extract },
     { "install", do_install },
     { "send", do_send },
@@ -697,6 +1141,13 @@ int main(int ac, const char** av)
   size_t i;
   int err;
 
+  init_opts(&opts);
+  if (parse_opts(&opts, &ac, &av))
+  {
+    i = n - 1;
+    goto on_help;
+  }
+
   if (ac <= 2)
   {
     i = n - 1;